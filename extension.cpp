@@ -1,30 +1,619 @@
+#include "guile_mmap.hpp"
 #include "guile_object.hpp"
 #include "guile_pack.hpp"
+#include "guile_parallel.hpp"
+#include "guile_rpc.hpp"
+#include "guile_scan.hpp"
+#include "guile_stats.hpp"
+#include "guile_stream.hpp"
+#include "guile_timestamp.hpp"
 #include "guile_unpack.hpp"
+#include "guile_view.hpp"
 
 extern "C" void guile_msgpack_module_init() noexcept;
 
-SCM guile_packScmToBytevector(SCM input) noexcept {
-  msgpack::sbuffer buf;
-  msgpack::packer<msgpack::sbuffer> packer(buf);
+namespace {
 
-  guile_pack::packDispatch(input, guile_object::guile_type_of(input), packer,
-                           guile_pack::pack_flags::override_unknowns | guile_pack::pack_flags::unknown_is_nil);
+constexpr guile_pack::flags_type default_pack_flags =
+    guile_pack::pack_flags::override_unknowns |
+    guile_pack::pack_flags::unknown_is_nil;
 
-  SCM bv = scm_c_make_bytevector(buf.size());
+// Optional flag arguments are or'ed into the defaults.
+guile_pack::flags_type packFlagsFrom(SCM flags) {
+  if (SCM_UNBNDP(flags) || scm_is_false(flags)) {
+    return default_pack_flags;
+  }
+  return default_pack_flags | scm_to_uint64(flags);
+}
 
+SCM bytevectorFromBuffer(const msgpack::sbuffer &buf) {
+  guile_stats::countPackedBytes(buf.size());
+  SCM bv = scm_c_make_bytevector(buf.size());
   memcpy(SCM_BYTEVECTOR_CONTENTS(bv), buf.data(), buf.size());
   return bv;
 }
 
-SCM guile_unpackScmFromBytevector(SCM input) noexcept {
-  msgpack::object_handle result;
-  msgpack::unpack(result, (const char *)SCM_BYTEVECTOR_CONTENTS(input),
-                  SCM_BYTEVECTOR_LENGTH(input));
-  return guile_unpack::unpackDispatch(result.get(), 0);
+// Run fn, turning C++ exceptions into a Scheme error.  The error is raised
+// after the C++ frames have unwound so no destructors are skipped.  Scheme
+// throws from inside fn pass straight through, so fn guards whatever it
+// owns with a guile_shared::unwind_scope.
+template <typename Fn> SCM guardedCall(const char *subr, Fn &&fn) noexcept {
+  SCM message = SCM_BOOL_F;
+  try {
+    return fn();
+  } catch (const std::exception &e) {
+    message = scm_from_utf8_string(e.what());
+  }
+  scm_misc_error(subr, "~A", scm_list_1(message));
+}
+
+} // namespace
+
+SCM guile_packScmToBytevector(SCM input, SCM flags) noexcept {
+  return guardedCall("msgpack-pack-scm", [&]() {
+    guile_shared::unwind_scope scope;
+    msgpack::sbuffer buf;
+    scope.destroy(buf);
+    msgpack::packer<msgpack::sbuffer> packer(buf);
+
+    guile_pack::packDocument(input, packer, packFlagsFrom(flags));
+
+    return bytevectorFromBuffer(buf);
+  });
+}
+
+// Optional unpack flags, e.g. msgpack-unpack-flag-arrays-as-lists.
+SCM guile_unpackScmFromBytevector(SCM input, SCM flags) noexcept {
+  static const char *subr = "msgpack-unpack-scm";
+  SCM_ASSERT_TYPE(scm_is_bytevector(input), input, SCM_ARG1, subr,
+                  "bytevector");
+  guile_unpack::flags_t cflags =
+      SCM_UNBNDP(flags) || scm_is_false(flags) ? 0 : scm_to_uint64(flags);
+
+  return guardedCall(subr, [&]() {
+    const char *data = (const char *)SCM_BYTEVECTOR_CONTENTS(input);
+    size_t len = SCM_BYTEVECTOR_LENGTH(input);
+    guile_scan::validate(data, len, 0, guile_scan::currentLimits());
+
+    guile_shared::unwind_scope scope;
+    msgpack::object_handle result;
+    scope.destroy(result);
+    msgpack::unpack(result, data, len);
+    return guile_unpack::unpackDocument(result.get(), cflags);
+  });
+}
+
+// Pack every element of a list or vector into one bytevector of
+// concatenated documents.  With a true second argument, also return a vector
+// of the start offset of each document.
+SCM guile_packManyToBytevector(SCM input, SCM with_offsets) noexcept {
+  static const char *subr = "msgpack-pack-many";
+  bool want_offsets = !SCM_UNBNDP(with_offsets) && scm_is_true(with_offsets);
+
+  size_t count;
+  if (scm_is_simple_vector(input)) {
+    count = SCM_SIMPLE_VECTOR_LENGTH(input);
+  } else {
+    SCM_ASSERT_TYPE(scm_is_true(scm_list_p(input)), input, SCM_ARG1, subr,
+                    "list or vector");
+    count = scm_to_size_t(scm_length(input));
+  }
+
+  SCM offsets =
+      want_offsets ? scm_c_make_vector(count, SCM_BOOL_F) : SCM_BOOL_F;
+
+  return guardedCall(subr, [&]() {
+    guile_shared::unwind_scope scope;
+    msgpack::sbuffer buf;
+    scope.destroy(buf);
+    msgpack::packer<msgpack::sbuffer> packer(buf);
+
+    SCM current = input;
+    for (size_t i = 0; i < count; i++) {
+      SCM value;
+      if (SCM_CONSP(current)) {
+        value = SCM_CAR(current);
+        current = SCM_CDR(current);
+      } else {
+        value = SCM_SIMPLE_VECTOR_REF(input, i);
+      }
+
+      if (want_offsets) {
+        SCM_SIMPLE_VECTOR_SET(offsets, i, scm_from_size_t(buf.size()));
+      }
+      guile_pack::packDocument(value, packer, default_pack_flags);
+    }
+
+    SCM bv = bytevectorFromBuffer(buf);
+    if (want_offsets) {
+      return scm_values(scm_list_2(bv, offsets));
+    }
+    return bv;
+  });
+}
+
+// Decode every document in a bytevector of concatenated documents into a
+// vector.  All documents share a single zone.
+SCM guile_unpackManyFromBytevector(SCM input) noexcept {
+  static const char *subr = "msgpack-unpack-many";
+  SCM_ASSERT_TYPE(scm_is_bytevector(input), input, SCM_ARG1, subr,
+                  "bytevector");
+
+  return guardedCall(subr, [&]() {
+    const char *data = (const char *)SCM_BYTEVECTOR_CONTENTS(input);
+    size_t len = SCM_BYTEVECTOR_LENGTH(input);
+
+    guile_shared::unwind_scope scope;
+    msgpack::zone zone;
+    scope.destroy(zone);
+    size_t offset = 0;
+    SCM acc = SCM_EOL;
+    while (offset < len) {
+      guile_scan::validate(data, len, offset, guile_scan::currentLimits());
+      msgpack::object obj =
+          msgpack::unpack(zone, data, len, offset,
+                          guile_shared::detail::referenceAll);
+      acc = scm_cons(guile_unpack::unpackDocument(obj, 0), acc);
+    }
+
+    return scm_vector(scm_reverse_x(acc, SCM_EOL));
+  });
+}
+
+// Pack every element of a vector on the shared worker pool.  Returns a
+// vector of bytevectors, or a single bytevector of concatenated documents
+// when the third argument is true.
+SCM guile_packParallel(SCM input, SCM threads, SCM concatenate) noexcept {
+  static const char *subr = "msgpack-pack-parallel";
+  SCM_ASSERT_TYPE(scm_is_simple_vector(input), input, SCM_ARG1, subr,
+                  "vector");
+
+  size_t nthreads = SCM_UNBNDP(threads) || scm_is_false(threads)
+                        ? guile_parallel::WorkerPool::defaultConcurrency()
+                        : scm_to_size_t(threads);
+  bool concat = !SCM_UNBNDP(concatenate) && scm_is_true(concatenate);
+
+  return guardedCall(subr, [&]() {
+    return guile_parallel::packParallel(input, nthreads, concat,
+                                        default_pack_flags);
+  });
+}
+
+// Decode a bytevector, converting the elements of a large top-level array on
+// the shared worker pool.
+SCM guile_unpackParallel(SCM input, SCM threads) noexcept {
+  static const char *subr = "msgpack-unpack-parallel";
+  SCM_ASSERT_TYPE(scm_is_bytevector(input), input, SCM_ARG1, subr,
+                  "bytevector");
+
+  size_t nthreads = SCM_UNBNDP(threads) || scm_is_false(threads)
+                        ? guile_parallel::WorkerPool::defaultConcurrency()
+                        : scm_to_size_t(threads);
+
+  return guardedCall(subr, [&]() {
+    SCM result = guile_parallel::unpackParallel(
+        (const char *)SCM_BYTEVECTOR_CONTENTS(input),
+        SCM_BYTEVECTOR_LENGTH(input), nthreads, 0);
+    // The workers read the contents; keep the bytevector alive until they
+    // are done.
+    scm_remember_upto_here_1(input);
+    return result;
+  });
+}
+
+SCM guile_viewFromBytevector(SCM input) noexcept {
+  static const char *subr = "msgpack-view";
+  SCM_ASSERT_TYPE(scm_is_bytevector(input), input, SCM_ARG1, subr,
+                  "bytevector");
+  return guardedCall(subr, [&]() { return guile_view::viewOf(input); });
+}
+
+SCM guile_viewP(SCM value) noexcept {
+  return scm_from_bool(guile_view::isView(value));
+}
+
+SCM guile_viewLength(SCM view) noexcept {
+  return guardedCall("msgpack-view-length", [&]() {
+    return scm_from_size_t(guile_view::length(view));
+  });
+}
+
+// Look up an array index or map key.  Containers come back as views, leaves
+// as decoded values, and missing entries as the optional default (#f).
+SCM guile_viewRef(SCM view, SCM key, SCM missing) noexcept {
+  if (SCM_UNBNDP(missing)) {
+    missing = SCM_BOOL_F;
+  }
+  return guardedCall("msgpack-view-ref", [&]() {
+    return guile_view::ref(view, key, missing, 0);
+  });
+}
+
+SCM guile_viewPathRef(SCM view, SCM path, SCM missing) noexcept {
+  if (SCM_UNBNDP(missing)) {
+    missing = SCM_BOOL_F;
+  }
+  return guardedCall("msgpack-view-path-ref", [&]() {
+    return guile_view::pathRef(view, path, missing, 0);
+  });
+}
+
+SCM guile_viewToScm(SCM view) noexcept {
+  return guardedCall("msgpack-view->scm",
+                     [&]() { return guile_view::toScm(view, 0); });
+}
+
+// Extract the values at a list of key paths from a bytevector without
+// decoding anything else.  Absent paths yield the optional default (#f).
+SCM guile_extractFromBytevector(SCM input, SCM paths, SCM missing) noexcept {
+  static const char *subr = "msgpack-extract";
+  SCM_ASSERT_TYPE(scm_is_bytevector(input), input, SCM_ARG1, subr,
+                  "bytevector");
+  SCM_ASSERT_TYPE(scm_is_true(scm_list_p(paths)), paths, SCM_ARG2, subr,
+                  "list");
+  if (SCM_UNBNDP(missing)) {
+    missing = SCM_BOOL_F;
+  }
+
+  return guardedCall(subr, [&]() {
+    return guile_view::extract((const char *)SCM_BYTEVECTOR_CONTENTS(input),
+                               SCM_BYTEVECTOR_LENGTH(input), paths, missing,
+                               0);
+  });
+}
+
+// Decode a msgpack file through a read-only mapping.  In reference mode (the
+// default) the object tree points into the mapping, so string and binary
+// payloads are copied exactly once, into their Guile objects.  The mapping is
+// released before returning.
+SCM guile_unpackFile(SCM path, SCM reference) noexcept {
+  static const char *subr = "msgpack-unpack-file";
+  SCM_ASSERT_TYPE(scm_is_string(path), path, SCM_ARG1, subr, "string");
+  bool use_reference = SCM_UNBNDP(reference) || scm_is_true(reference);
+
+  return guardedCall(subr, [&]() {
+    guile_shared::unwind_scope scope;
+    size_t len;
+    std::unique_ptr<char, guile_shared::detail::malloc_deleter> cpath{
+        scm_to_utf8_stringn(path, &len)};
+    scope.destroy(cpath);
+    guile_mmap::MappedFile file(cpath.get());
+    scope.destroy(file);
+    guile_scan::validate(file.data(), file.size(), 0,
+                         guile_scan::currentLimits());
+    msgpack::object_handle result;
+    scope.destroy(result);
+    msgpack::unpack(result, file.data(), file.size(),
+                    use_reference ? guile_shared::detail::referenceAll
+                                  : nullptr);
+    return guile_unpack::unpackDocument(result.get(), 0);
+  });
+}
+
+// Pack a value straight into a file through a growable shared mapping.
+// Returns the number of bytes written.
+SCM guile_packToFile(SCM input, SCM path) noexcept {
+  static const char *subr = "msgpack-pack-to-file";
+  SCM_ASSERT_TYPE(scm_is_string(path), path, SCM_ARG2, subr, "string");
+
+  size_t len;
+  std::unique_ptr<char, guile_shared::detail::malloc_deleter> cpath{
+      scm_to_utf8_stringn(path, &len)};
+
+  return guardedCall(subr, [&]() {
+    // A throw while packing must still remove the temporary file.
+    guile_shared::unwind_scope scope;
+    guile_mmap::MappedOutputFile file(cpath.get());
+    scope.destroy(file);
+    msgpack::packer<guile_mmap::MappedOutputFile> packer(file);
+    guile_pack::packDocument(input, packer, default_pack_flags);
+    file.finish();
+    guile_stats::countPackedBytes(file.size());
+    return scm_from_size_t(file.size());
+  });
+}
+
+// Pack a value, framing it as a compressed ext when it packs to at least
+// `threshold` bytes (4096 by default) and compression pays off.
+SCM guile_packCompressed(SCM input, SCM threshold, SCM flags) noexcept {
+  static const char *subr = "msgpack-pack-compressed";
+  size_t cthreshold = SCM_UNBNDP(threshold) || scm_is_false(threshold)
+                          ? guile_pack::default_compress_threshold
+                          : scm_to_size_t(threshold);
+
+  return guardedCall(subr, [&]() {
+    guile_shared::unwind_scope scope;
+    msgpack::sbuffer buf;
+    scope.destroy(buf);
+    guile_pack::packCompressed(input, buf, packFlagsFrom(flags), cthreshold);
+    return bytevectorFromBuffer(buf);
+  });
+}
+
+// Streaming writer over an output port.  Values written to a writer with no
+// open container are packed as separate documents.
+SCM guile_makeWriter(SCM port, SCM flags) noexcept {
+  static const char *subr = "msgpack-writer";
+  SCM_ASSERT_TYPE(scm_is_true(scm_output_port_p(port)), port, SCM_ARG1, subr,
+                  "output port");
+  return guardedCall(subr, [&]() {
+    return guile_stream::makeWriter(port, packFlagsFrom(flags));
+  });
+}
+
+SCM guile_writerWrite(SCM writer, SCM value) noexcept {
+  return guardedCall("msgpack-writer-write!", [&]() {
+    guile_stream::write(guile_stream::stateOf(writer), value);
+    return SCM_UNSPECIFIED;
+  });
+}
+
+// Without a count, the header is patched on end; the port must be seekable.
+SCM guile_writerBeginArray(SCM writer, SCM count) noexcept {
+  return guardedCall("msgpack-writer-begin-array!", [&]() {
+    guile_stream::begin(guile_stream::stateOf(writer), false, count);
+    return SCM_UNSPECIFIED;
+  });
+}
+
+SCM guile_writerBeginMap(SCM writer, SCM count) noexcept {
+  return guardedCall("msgpack-writer-begin-map!", [&]() {
+    guile_stream::begin(guile_stream::stateOf(writer), true, count);
+    return SCM_UNSPECIFIED;
+  });
+}
+
+SCM guile_writerEnd(SCM writer) noexcept {
+  return guardedCall("msgpack-writer-end!", [&]() {
+    guile_stream::end(guile_stream::stateOf(writer));
+    return SCM_UNSPECIFIED;
+  });
+}
+
+// Pack every value a generator yields as one array written to a port.
+// Returns the number of elements.
+SCM guile_packGenerator(SCM port, SCM generator, SCM count,
+                        SCM flags) noexcept {
+  static const char *subr = "msgpack-pack-generator";
+  SCM_ASSERT_TYPE(scm_is_true(scm_output_port_p(port)), port, SCM_ARG1, subr,
+                  "output port");
+  SCM_ASSERT_TYPE(scm_is_true(scm_procedure_p(generator)), generator,
+                  SCM_ARG2, subr, "procedure");
+  return guardedCall(subr, [&]() {
+    return guile_stream::packGenerator(port, generator, count,
+                                       packFlagsFrom(flags));
+  });
+}
+
+// Make a msgpack-RPC server with no methods and no listeners.  Optional
+// pack flags apply to every result.
+SCM guile_makeRpcServer(SCM flags) noexcept {
+  return guile_rpc::makeServer(packFlagsFrom(flags), 0);
+}
+
+// Register the procedure called with a request's params for a method name.
+SCM guile_rpcServerRegister(SCM server, SCM method, SCM procedure) noexcept {
+  static const char *subr = "msgpack-rpc-server-register!";
+  SCM_ASSERT_TYPE(scm_is_string(method), method, SCM_ARG2, subr, "string");
+  SCM_ASSERT_TYPE(scm_is_true(scm_procedure_p(procedure)), procedure,
+                  SCM_ARG3, subr, "procedure");
+
+  size_t len;
+  std::unique_ptr<char, guile_shared::detail::malloc_deleter> name{
+      scm_to_utf8_stringn(method, &len)};
+  return guardedCall(subr, [&]() {
+    guile_rpc::registerMethod(guile_rpc::stateOf(server),
+                              std::string_view(name.get(), len), procedure);
+    return SCM_UNSPECIFIED;
+  });
+}
+
+SCM guile_rpcServerListenUnix(SCM server, SCM path) noexcept {
+  static const char *subr = "msgpack-rpc-server-listen-unix!";
+  SCM_ASSERT_TYPE(scm_is_string(path), path, SCM_ARG2, subr, "string");
+
+  size_t len;
+  std::unique_ptr<char, guile_shared::detail::malloc_deleter> cpath{
+      scm_to_utf8_stringn(path, &len)};
+  return guardedCall(subr, [&]() {
+    guile_rpc::listenUnix(guile_rpc::stateOf(server), cpath.get());
+    return SCM_UNSPECIFIED;
+  });
+}
+
+// Listen on a TCP address; port 0 picks a free port.  Returns the bound
+// port.
+SCM guile_rpcServerListenTcp(SCM server, SCM host, SCM port) noexcept {
+  static const char *subr = "msgpack-rpc-server-listen-tcp!";
+  SCM_ASSERT_TYPE(scm_is_string(host), host, SCM_ARG2, subr, "string");
+
+  size_t len;
+  std::unique_ptr<char, guile_shared::detail::malloc_deleter> chost{
+      scm_to_utf8_stringn(host, &len)};
+  uint16_t cport = scm_to_uint16(port);
+  return guardedCall(subr, [&]() {
+    return scm_from_uint16(
+        guile_rpc::listenTcp(guile_rpc::stateOf(server), chost.get(), cport));
+  });
+}
+
+// Serve on the calling thread until msgpack-rpc-server-stop! is called.
+SCM guile_rpcServerRun(SCM server) noexcept {
+  return guardedCall("msgpack-rpc-server-run", [&]() {
+    guile_rpc::run(guile_rpc::stateOf(server));
+    scm_remember_upto_here_1(server);
+    return SCM_UNSPECIFIED;
+  });
+}
+
+SCM guile_rpcServerStop(SCM server) noexcept {
+  guile_rpc::stop(guile_rpc::stateOf(server));
+  return SCM_UNSPECIFIED;
+}
+
+// Register a record type under a tag so that its instances pack as a typed
+// ext and decode back into records.  The optional field list fixes the wire
+// order.
+SCM guile_registerRecord(SCM rtd, SCM tag, SCM fields) noexcept {
+  static const char *subr = "msgpack-register-record!";
+  SCM_ASSERT_TYPE(SCM_STRUCTP(rtd), rtd, SCM_ARG1, subr, "record type");
+  size_t ctag = scm_to_size_t(tag);
+
+  return guardedCall(subr, [&]() {
+    guile_record::registerRecord(rtd, ctag, fields);
+    return SCM_UNSPECIFIED;
+  });
+}
+
+// Decode exts with the given id by calling proc on a bytevector of the body.
+SCM guile_registerExtUnpacker(SCM ext_id, SCM proc) noexcept {
+  static const char *subr = "msgpack-register-ext-unpacker!";
+  SCM_ASSERT_TYPE(scm_is_true(scm_procedure_p(proc)), proc, SCM_ARG2, subr,
+                  "procedure");
+  int8_t id = scm_to_int8(ext_id);
+
+  return guardedCall(subr, [&]() {
+    guile_ext::registerUnpacker(id, {nullptr, nullptr, proc});
+    return SCM_UNSPECIFIED;
+  });
+}
+
+// Pack values of a type as exts with the given id.  The type is either a
+// symbol naming a guile_type (such as 'pointer) or a struct vtable, and
+// proc returns the ext body as a bytevector, or #f to pack normally.
+SCM guile_registerExtPacker(SCM type, SCM ext_id, SCM proc) noexcept {
+  static const char *subr = "msgpack-register-ext-packer!";
+  SCM_ASSERT_TYPE(scm_is_true(scm_procedure_p(proc)), proc, SCM_ARG3, subr,
+                  "procedure");
+  SCM_ASSERT_TYPE(scm_is_symbol(type) || SCM_STRUCTP(type), type, SCM_ARG1,
+                  subr, "symbol or vtable");
+  int8_t id = scm_to_int8(ext_id);
+  std::string type_name =
+      scm_is_symbol(type)
+          ? guile_record::detail::utf8Of(scm_symbol_to_string(type))
+          : std::string();
+
+  return guardedCall(subr, [&]() {
+    guile_ext::pack_handler handler{id, nullptr, nullptr, proc};
+    if (type_name.empty()) {
+      guile_record::registerVtablePacker(type, handler);
+      return SCM_UNSPECIFIED;
+    }
+
+    for (size_t i = 0; i < guile_ext::guile_type_count; i++) {
+      auto gt = static_cast<guile_object::guile_type>(i);
+      if (guile_object::display(gt) == type_name) {
+        guile_ext::registerTypePacker(gt, handler);
+        return SCM_UNSPECIFIED;
+      }
+    }
+    throw guile_ext::ext_error("unknown guile type " + type_name);
+  });
+}
+
+// Counters gathered when built with -Dstats=true, as an alist.
+SCM guile_statsAlist() noexcept {
+  return guardedCall("msgpack-stats", []() { return guile_stats::toAlist(); });
+}
+
+SCM guile_statsReset() noexcept {
+  guile_stats::reset();
+  return SCM_UNSPECIFIED;
+}
+
+// Set the limits checked before any input is decoded: maximum nesting depth,
+// elements per container and bytes per string, binary or ext payload.  #f
+// or an omitted argument keeps the current value.  Returns the previous
+// limits as a list of three integers.
+SCM guile_setUnpackLimits(SCM depth, SCM container, SCM payload) noexcept {
+  static const char *subr = "msgpack-set-unpack-limits!";
+  guile_scan::limits previous = guile_scan::currentLimits();
+  guile_scan::limits next = previous;
+
+  auto update = [](SCM value, uint32_t &field) {
+    if (!SCM_UNBNDP(value) && scm_is_true(value)) {
+      field = scm_to_uint32(value);
+    }
+  };
+  update(depth, next.max_depth);
+  update(container, next.max_container);
+  update(payload, next.max_payload);
+  if (next.max_depth == 0) {
+    scm_misc_error(subr, "depth limit must be positive", SCM_EOL);
+  }
+
+  guile_scan::setLimits(next);
+  return scm_list_3(scm_from_uint32(previous.max_depth),
+                    scm_from_uint32(previous.max_container),
+                    scm_from_uint32(previous.max_payload));
 }
 
 extern "C" void guile_msgpack_module_init() noexcept {
-  scm_c_define_gsubr("msgpack-pack-scm", 1, 0, 0, (void*)&guile_packScmToBytevector);
-  scm_c_define_gsubr("msgpack-unpack-scm", 1, 0, 0, (void*)&guile_unpackScmFromBytevector);
+  guile_view::initViewType();
+  guile_stream::initWriterType();
+  guile_rpc::initServerType();
+  guile_timestamp::install();
+
+  scm_c_define("msgpack-pack-flag-no-symbol-ext",
+               scm_from_uint64(static_cast<uint64_t>(
+                   guile_pack::pack_flags::disable_symbol_extension)));
+  scm_c_define("msgpack-pack-flag-no-keyword-ext",
+               scm_from_uint64(static_cast<uint64_t>(
+                   guile_pack::pack_flags::disable_keyword_extension)));
+  scm_c_define("msgpack-pack-flag-records-positional",
+               scm_from_uint64(static_cast<uint64_t>(
+                   guile_pack::pack_flags::records_positional)));
+  scm_c_define("msgpack-pack-flag-share-structure",
+               scm_from_uint64(static_cast<uint64_t>(
+                   guile_pack::pack_flags::share_structure)));
+  scm_c_define("msgpack-pack-flag-canonical",
+               scm_from_uint64(static_cast<uint64_t>(
+                   guile_pack::pack_flags::canonical)));
+  scm_c_define("msgpack-pack-flag-alist-as-map",
+               scm_from_uint64(static_cast<uint64_t>(
+                   guile_pack::pack_flags::alist_as_map)));
+  scm_c_define("msgpack-pack-flag-ext-pairs",
+               scm_from_uint64(static_cast<uint64_t>(
+                   guile_pack::pack_flags::ext_pairs)));
+  scm_c_define("msgpack-unpack-flag-arrays-as-lists",
+               scm_from_uint64(static_cast<uint64_t>(
+                   guile_unpack::unpack_flags::arrays_as_lists)));
+  scm_c_define("msgpack-unpack-flag-maps-as-alists",
+               scm_from_uint64(static_cast<uint64_t>(
+                   guile_unpack::unpack_flags::maps_as_alists)));
+
+  scm_c_define_gsubr("msgpack-pack-scm", 1, 1, 0, (void*)&guile_packScmToBytevector);
+  scm_c_define_gsubr("msgpack-unpack-scm", 1, 1, 0, (void*)&guile_unpackScmFromBytevector);
+  scm_c_define_gsubr("msgpack-pack-many", 1, 1, 0, (void*)&guile_packManyToBytevector);
+  scm_c_define_gsubr("msgpack-unpack-many", 1, 0, 0, (void*)&guile_unpackManyFromBytevector);
+  scm_c_define_gsubr("msgpack-pack-parallel", 1, 2, 0, (void*)&guile_packParallel);
+  scm_c_define_gsubr("msgpack-unpack-parallel", 1, 1, 0, (void*)&guile_unpackParallel);
+  scm_c_define_gsubr("msgpack-view", 1, 0, 0, (void*)&guile_viewFromBytevector);
+  scm_c_define_gsubr("msgpack-view?", 1, 0, 0, (void*)&guile_viewP);
+  scm_c_define_gsubr("msgpack-view-length", 1, 0, 0, (void*)&guile_viewLength);
+  scm_c_define_gsubr("msgpack-view-ref", 2, 1, 0, (void*)&guile_viewRef);
+  scm_c_define_gsubr("msgpack-view-path-ref", 2, 1, 0, (void*)&guile_viewPathRef);
+  scm_c_define_gsubr("msgpack-view->scm", 1, 0, 0, (void*)&guile_viewToScm);
+  scm_c_define_gsubr("msgpack-extract", 2, 1, 0, (void*)&guile_extractFromBytevector);
+  scm_c_define_gsubr("msgpack-unpack-file", 1, 1, 0, (void*)&guile_unpackFile);
+  scm_c_define_gsubr("msgpack-pack-to-file", 2, 0, 0, (void*)&guile_packToFile);
+  scm_c_define_gsubr("msgpack-pack-compressed", 1, 2, 0, (void*)&guile_packCompressed);
+  scm_c_define_gsubr("msgpack-writer", 1, 1, 0, (void*)&guile_makeWriter);
+  scm_c_define_gsubr("msgpack-writer-write!", 2, 0, 0, (void*)&guile_writerWrite);
+  scm_c_define_gsubr("msgpack-writer-begin-array!", 1, 1, 0, (void*)&guile_writerBeginArray);
+  scm_c_define_gsubr("msgpack-writer-begin-map!", 1, 1, 0, (void*)&guile_writerBeginMap);
+  scm_c_define_gsubr("msgpack-writer-end!", 1, 0, 0, (void*)&guile_writerEnd);
+  scm_c_define_gsubr("msgpack-pack-generator", 2, 2, 0, (void*)&guile_packGenerator);
+  scm_c_define_gsubr("msgpack-rpc-server", 0, 1, 0, (void*)&guile_makeRpcServer);
+  scm_c_define_gsubr("msgpack-rpc-server-register!", 3, 0, 0, (void*)&guile_rpcServerRegister);
+  scm_c_define_gsubr("msgpack-rpc-server-listen-unix!", 2, 0, 0, (void*)&guile_rpcServerListenUnix);
+  scm_c_define_gsubr("msgpack-rpc-server-listen-tcp!", 3, 0, 0, (void*)&guile_rpcServerListenTcp);
+  scm_c_define_gsubr("msgpack-rpc-server-run", 1, 0, 0, (void*)&guile_rpcServerRun);
+  scm_c_define_gsubr("msgpack-rpc-server-stop!", 1, 0, 0, (void*)&guile_rpcServerStop);
+  scm_c_define_gsubr("msgpack-register-record!", 2, 1, 0, (void*)&guile_registerRecord);
+  scm_c_define_gsubr("msgpack-register-ext-unpacker!", 2, 0, 0, (void*)&guile_registerExtUnpacker);
+  scm_c_define_gsubr("msgpack-register-ext-packer!", 3, 0, 0, (void*)&guile_registerExtPacker);
+  scm_c_define_gsubr("msgpack-stats", 0, 0, 0, (void*)&guile_statsAlist);
+  scm_c_define_gsubr("msgpack-stats-reset!", 0, 0, 0, (void*)&guile_statsReset);
+  scm_c_define_gsubr("msgpack-set-unpack-limits!", 0, 3, 0, (void*)&guile_setUnpackLimits);
 }
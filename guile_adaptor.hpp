@@ -0,0 +1,77 @@
+#pragma once
+
+#include "guile_object.hpp"
+#include "guile_pack.hpp"
+#include "guile_unpack.hpp"
+
+#include <msgpack.hpp>
+
+// msgpack-c adaptors for Scheme values, so that they can sit inside
+// MSGPACK_DEFINE structs and standard containers and be packed in the same
+// pass as the C++ data around them.
+//
+// SCM is an integer typedef in this build (guile_object.hpp sets
+// SCM_DEBUG_TYPING_STRICTNESS to 0), so adaptors for SCM itself would
+// capture every uintptr_t.  Values are wrapped in scm_value instead, which
+// converts implicitly to and from SCM.
+//
+// The collector does not scan the C++ heap: an scm_value held in a
+// std::vector or any other heap allocation does not keep its value alive.
+// Protect such values for as long as the container holds them.
+namespace guile_adaptor {
+
+constexpr guile_pack::flags_type default_pack_flags =
+    guile_pack::pack_flags::override_unknowns |
+    guile_pack::pack_flags::unknown_is_nil;
+
+struct scm_value {
+  SCM value = SCM_BOOL_F;
+  guile_pack::flags_type pack_flags = default_pack_flags;
+  guile_unpack::flags_t unpack_flags = 0;
+
+  scm_value() = default;
+  scm_value(SCM v) : value(v) {}
+  scm_value(SCM v, guile_pack::flags_type flags) : value(v), pack_flags(flags) {}
+
+  operator SCM() const noexcept { return value; }
+};
+
+} // namespace guile_adaptor
+
+namespace msgpack {
+MSGPACK_API_VERSION_NAMESPACE(MSGPACK_DEFAULT_API_NS) {
+namespace adaptor {
+
+template <> struct pack<guile_adaptor::scm_value> {
+  template <typename Stream>
+  msgpack::packer<Stream> &operator()(msgpack::packer<Stream> &o,
+                                      const guile_adaptor::scm_value &v) const {
+    guile_pack::packDocument(v.value, o, v.pack_flags);
+    return o;
+  }
+};
+
+template <> struct convert<guile_adaptor::scm_value> {
+  const msgpack::object &operator()(const msgpack::object &o,
+                                    guile_adaptor::scm_value &v) const {
+    v.value = guile_unpack::unpackDocument(o, v.unpack_flags);
+    return o;
+  }
+};
+
+/// Builds the msgpack::object by packing and re-reading the value, copying
+/// every payload into the zone.
+template <> struct object_with_zone<guile_adaptor::scm_value> {
+  void operator()(msgpack::object::with_zone &o,
+                  const guile_adaptor::scm_value &v) const {
+    msgpack::sbuffer buf;
+    msgpack::packer<msgpack::sbuffer> packer(buf);
+    guile_pack::packDocument(v.value, packer, v.pack_flags);
+    static_cast<msgpack::object &>(o) =
+        msgpack::unpack(o.zone, buf.data(), buf.size());
+  }
+};
+
+} // namespace adaptor
+} // MSGPACK_API_VERSION_NAMESPACE(MSGPACK_DEFAULT_API_NS)
+} // namespace msgpack
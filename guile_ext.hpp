@@ -0,0 +1,195 @@
+#pragma once
+
+#include "guile_object.hpp"
+#include "guile_shared.hpp"
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#include <msgpack.hpp>
+
+// Registry of user extension types.  Decoding is keyed on the ext id, packing
+// on the guile_type of a value or on a struct vtable.  Handlers are either C++
+// callbacks or Scheme procedures, and every lookup is a single array load.
+namespace guile_ext {
+
+using ext_error = std::runtime_error;
+
+/// Where a C++ pack handler writes an ext body.  Bodies of up to
+/// inline_size bytes stay inside the object, which lives on the packer's
+/// stack; only longer ones spill to the heap.  Usable as a msgpack::packer
+/// stream.
+class body_buffer {
+public:
+  static constexpr size_t inline_size = 32;
+
+  body_buffer() = default;
+  body_buffer(const body_buffer &) = delete;
+  body_buffer &operator=(const body_buffer &) = delete;
+
+  void write(const char *data, size_t len) {
+    if (heap_.empty() && len <= inline_size - size_) {
+      std::memcpy(inline_ + size_, data, len);
+    } else {
+      if (heap_.empty()) {
+        heap_.assign(inline_, inline_ + size_);
+      }
+      heap_.insert(heap_.end(), data, data + len);
+    }
+    size_ += len;
+  }
+
+  const char *data() const noexcept {
+    return heap_.empty() ? inline_ : heap_.data();
+  }
+  size_t size() const noexcept { return size_; }
+
+private:
+  char inline_[inline_size];
+  std::vector<char> heap_;
+  size_t size_ = 0;
+};
+
+/// Write the ext body for value into body.  Return false to decline, in
+/// which case the value is packed as if no handler were registered.
+using pack_fn = bool (*)(SCM value, body_buffer &body, void *user);
+
+/// Build a value from an ext body.
+using unpack_fn = SCM (*)(const char *data, size_t len, void *user);
+
+struct pack_handler {
+  int8_t ext_id;
+  pack_fn fn;
+  void *user;
+  // Used instead of fn unless #f: (proc value) => bytevector or #f.
+  SCM procedure;
+};
+
+struct unpack_handler {
+  unpack_fn fn;
+  void *user;
+  // Used instead of fn unless #f: (proc bytevector) => value.
+  SCM procedure;
+};
+
+constexpr size_t guile_type_count =
+    static_cast<size_t>(guile_object::guile_type::invalid) + 1;
+
+namespace detail {
+
+struct registry {
+  std::mutex mutex;
+  std::array<std::atomic<const unpack_handler *>, 256> by_ext_id{};
+  std::array<std::atomic<const pack_handler *>, guile_type_count> by_type{};
+};
+
+inline registry &table() {
+  static registry *r = new registry();
+  return *r;
+}
+
+inline bool isReserved(int8_t ext_id) noexcept {
+  return ext_id == guile_shared::nil_ext_id ||
+         ext_id == guile_shared::symbol_ext_id ||
+         ext_id == guile_shared::keyword_ext_id ||
+         ext_id == guile_shared::record_ext_id ||
+         ext_id == guile_shared::shared_def_ext_id ||
+         ext_id == guile_shared::shared_ref_ext_id ||
+         ext_id == guile_shared::compressed_ext_id ||
+         (ext_id >= guile_shared::record_tag_ext_id_first &&
+          ext_id < guile_shared::record_tag_ext_id_first +
+                       static_cast<int>(guile_shared::record_tag_count));
+}
+
+inline void checkExtId(int8_t ext_id) {
+  if (isReserved(ext_id)) {
+    throw ext_error("ext id is reserved by guile-mpack");
+  }
+}
+
+} // namespace detail
+
+inline const unpack_handler *unpackerFor(int8_t ext_id) noexcept {
+  return detail::table()
+      .by_ext_id[static_cast<uint8_t>(ext_id)]
+      .load(std::memory_order_acquire);
+}
+
+inline const pack_handler *packerFor(guile_object::guile_type gt) noexcept {
+  return detail::table()
+      .by_type[static_cast<size_t>(gt)]
+      .load(std::memory_order_acquire);
+}
+
+/// Handlers are never freed; re-registering replaces the published pointer
+/// and leaks the old entry, which may still be in use on another thread.
+inline void registerUnpacker(int8_t ext_id, unpack_handler handler) {
+  detail::checkExtId(ext_id);
+  if (scm_is_true(handler.procedure)) {
+    scm_gc_protect_object(handler.procedure);
+  }
+  auto &r = detail::table();
+  std::lock_guard lock(r.mutex);
+  r.by_ext_id[static_cast<uint8_t>(ext_id)].store(
+      new unpack_handler(handler), std::memory_order_release);
+}
+
+inline const pack_handler *makePackHandler(pack_handler handler) {
+  detail::checkExtId(handler.ext_id);
+  if (scm_is_true(handler.procedure)) {
+    scm_gc_protect_object(handler.procedure);
+  }
+  return new pack_handler(handler);
+}
+
+inline void registerTypePacker(guile_object::guile_type gt,
+                               pack_handler handler) {
+  const pack_handler *published = makePackHandler(handler);
+  auto &r = detail::table();
+  std::lock_guard lock(r.mutex);
+  r.by_type[static_cast<size_t>(gt)].store(published,
+                                           std::memory_order_release);
+}
+
+/// Pack value as an ext using handler.  Returns false when the handler
+/// declined and nothing was written.
+template <typename T>
+inline bool packWith(const pack_handler &handler, SCM value,
+                     msgpack::packer<T> &packer) {
+  if (scm_is_true(handler.procedure)) {
+    SCM body = scm_call_1(handler.procedure, value);
+    if (scm_is_false(body)) {
+      return false;
+    }
+    if (!scm_is_bytevector(body)) {
+      throw ext_error("ext pack procedure must return a bytevector or #f");
+    }
+    packer.pack_ext(SCM_BYTEVECTOR_LENGTH(body), handler.ext_id);
+    packer.pack_ext_body((const char *)SCM_BYTEVECTOR_CONTENTS(body),
+                         SCM_BYTEVECTOR_LENGTH(body));
+    return true;
+  }
+
+  body_buffer body;
+  if (!handler.fn(value, body, handler.user)) {
+    return false;
+  }
+  packer.pack_ext(body.size(), handler.ext_id);
+  packer.pack_ext_body(body.data(), body.size());
+  return true;
+}
+
+inline SCM unpackWith(const unpack_handler &handler, const char *data,
+                      size_t len) {
+  if (scm_is_true(handler.procedure)) {
+    SCM body = scm_c_make_bytevector(len);
+    memcpy(SCM_BYTEVECTOR_CONTENTS(body), data, len);
+    return scm_call_1(handler.procedure, body);
+  }
+  return handler.fn(data, len, handler.user);
+}
+
+} // namespace guile_ext
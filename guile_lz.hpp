@@ -0,0 +1,181 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// A small, dependency free LZ77 block codec using the LZ4 block format:
+// greedy matching over a 64 KiB window with a single hash probe per
+// position.  The ratio is well below a full LZ4 or zstd, but repeated map
+// keys, which dominate large packed payloads, compress very well.
+namespace guile_lz {
+
+/// Largest possible compressed size for n input bytes.
+constexpr size_t compressBound(size_t n) noexcept {
+  return n + n / 255 + 16;
+}
+
+namespace detail {
+
+constexpr unsigned hash_bits = 14;
+// A match may not start within the last 12 bytes, and the last 5 bytes are
+// always literals, as the block format requires.
+constexpr size_t match_limit = 12;
+constexpr size_t last_literals = 5;
+constexpr size_t min_match = 4;
+constexpr size_t max_offset = 65535;
+
+inline uint32_t read32(const uint8_t *p) noexcept {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline uint32_t hash(uint32_t seq) noexcept {
+  return (seq * 2654435761u) >> (32 - hash_bits);
+}
+
+inline uint8_t *writeLength(uint8_t *op, size_t len) noexcept {
+  for (; len >= 255; len -= 255) {
+    *op++ = 255;
+  }
+  *op++ = static_cast<uint8_t>(len);
+  return op;
+}
+
+inline uint8_t *writeSequence(uint8_t *op, const uint8_t *literals,
+                              size_t n_literals, size_t offset,
+                              size_t match_len) noexcept {
+  uint8_t *token = op++;
+  *token = static_cast<uint8_t>((n_literals < 15 ? n_literals : 15) << 4);
+  if (n_literals >= 15) {
+    op = writeLength(op, n_literals - 15);
+  }
+  memcpy(op, literals, n_literals);
+  op += n_literals;
+  if (match_len == 0) {
+    return op;
+  }
+
+  *op++ = static_cast<uint8_t>(offset);
+  *op++ = static_cast<uint8_t>(offset >> 8);
+  size_t extra = match_len - min_match;
+  *token |= static_cast<uint8_t>(extra < 15 ? extra : 15);
+  if (extra >= 15) {
+    op = writeLength(op, extra - 15);
+  }
+  return op;
+}
+
+} // namespace detail
+
+/// Compress n bytes from src into dst, which must hold compressBound(n)
+/// bytes.  Returns the compressed size.
+inline size_t compress(const char *src, size_t n, char *dst) {
+  using namespace detail;
+  const auto *in = reinterpret_cast<const uint8_t *>(src);
+  auto *op = reinterpret_cast<uint8_t *>(dst);
+
+  // Positions are stored plus one so that zero means empty.
+  std::vector<uint32_t> table(size_t{1} << hash_bits, 0);
+  size_t anchor = 0;
+  size_t ip = 0;
+
+  while (ip + match_limit < n) {
+    uint32_t seq = read32(in + ip);
+    uint32_t h = hash(seq);
+    size_t candidate = table[h];
+    table[h] = static_cast<uint32_t>(ip + 1);
+
+    if (candidate == 0 || ip - (candidate - 1) > max_offset ||
+        read32(in + candidate - 1) != seq) {
+      ip++;
+      continue;
+    }
+
+    size_t ref = candidate - 1;
+    size_t len = min_match;
+    while (ip + len < n - last_literals && in[ref + len] == in[ip + len]) {
+      len++;
+    }
+    op = writeSequence(op, in + anchor, ip - anchor, ip - ref, len);
+    ip += len;
+    anchor = ip;
+  }
+
+  op = writeSequence(op, in + anchor, n - anchor, 0, 0);
+  return op - reinterpret_cast<uint8_t *>(dst);
+}
+
+/// Decompress a block into exactly out_n bytes at dst.  Returns false on any
+/// malformed input, including input that would write past out_n or that
+/// decodes to fewer bytes.
+inline bool decompress(const char *src, size_t n, char *dst, size_t out_n) {
+  using detail::min_match;
+  const auto *in = reinterpret_cast<const uint8_t *>(src);
+  auto *out = reinterpret_cast<uint8_t *>(dst);
+  size_t ip = 0;
+  size_t op = 0;
+
+  auto readLength = [&](size_t &len) {
+    uint8_t b;
+    do {
+      if (ip >= n) {
+        return false;
+      }
+      b = in[ip++];
+      len += b;
+    } while (b == 255);
+    return true;
+  };
+
+  while (ip < n) {
+    uint8_t token = in[ip++];
+
+    size_t n_literals = token >> 4;
+    if (n_literals == 15 && !readLength(n_literals)) {
+      return false;
+    }
+    if (n_literals > n - ip || n_literals > out_n - op) {
+      return false;
+    }
+    memcpy(out + op, in + ip, n_literals);
+    ip += n_literals;
+    op += n_literals;
+    if (ip == n) {
+      break;
+    }
+
+    if (n - ip < 2) {
+      return false;
+    }
+    size_t offset = in[ip] | (size_t{in[ip + 1]} << 8);
+    ip += 2;
+    if (offset == 0 || offset > op) {
+      return false;
+    }
+
+    size_t len = token & 15;
+    if (len == 15 && !readLength(len)) {
+      return false;
+    }
+    len += min_match;
+    if (len > out_n - op) {
+      return false;
+    }
+
+    const uint8_t *match = out + op - offset;
+    if (offset >= len) {
+      memcpy(out + op, match, len);
+    } else {
+      // Overlapping copy repeats the last `offset` bytes.
+      for (size_t i = 0; i < len; i++) {
+        out[op + i] = match[i];
+      }
+    }
+    op += len;
+  }
+  return op == out_n;
+}
+
+} // namespace guile_lz
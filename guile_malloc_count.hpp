@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdlib>
+
+// Counting of C heap allocations for the test and benchmark executables, by
+// interposing malloc and friends on glibc.  Counting is per thread and only
+// while `counting` is set.  This defines malloc itself, so include it from
+// exactly one translation unit of an executable and never from the
+// extension.
+
+namespace guile_malloc_count {
+inline thread_local bool counting = false;
+inline thread_local size_t allocations = 0;
+} // namespace guile_malloc_count
+
+#if defined(__GLIBC__)
+#define GUILE_MALLOC_COUNT_INTERPOSED 1
+
+extern "C" {
+void *__libc_malloc(size_t);
+void *__libc_calloc(size_t, size_t);
+void *__libc_realloc(void *, size_t);
+void *__libc_memalign(size_t, size_t);
+void __libc_free(void *);
+}
+
+namespace guile_malloc_count::detail {
+inline void *counted(void *p) {
+  if (counting) {
+    allocations++;
+  }
+  return p;
+}
+} // namespace guile_malloc_count::detail
+
+extern "C" {
+void *malloc(size_t n) {
+  return guile_malloc_count::detail::counted(__libc_malloc(n));
+}
+void *calloc(size_t n, size_t size) {
+  return guile_malloc_count::detail::counted(__libc_calloc(n, size));
+}
+void *realloc(void *p, size_t n) {
+  return guile_malloc_count::detail::counted(__libc_realloc(p, n));
+}
+void *memalign(size_t align, size_t n) {
+  return guile_malloc_count::detail::counted(__libc_memalign(align, n));
+}
+void *aligned_alloc(size_t align, size_t n) {
+  return guile_malloc_count::detail::counted(__libc_memalign(align, n));
+}
+int posix_memalign(void **out, size_t align, size_t n) {
+  void *p = __libc_memalign(align, n);
+  if (p == nullptr) {
+    return ENOMEM;
+  }
+  *out = guile_malloc_count::detail::counted(p);
+  return 0;
+}
+void free(void *p) { __libc_free(p); }
+}
+#else
+#define GUILE_MALLOC_COUNT_INTERPOSED 0
+#endif
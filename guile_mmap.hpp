@@ -0,0 +1,193 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Memory mapped file access for decoding straight from disk and packing
+// straight to it.
+namespace guile_mmap {
+
+using mmap_error = std::runtime_error;
+
+namespace detail {
+
+[[noreturn]] inline void throwErrno(const std::string &what,
+                                    const std::string &path, int err) {
+  throw mmap_error(what + " " + path + ": " + std::strerror(err));
+}
+
+/// The process umask.  There is no way to read it without setting it, so it
+/// is set back straight away.
+inline mode_t currentUmask() noexcept {
+  mode_t mask = ::umask(022);
+  ::umask(mask);
+  return mask;
+}
+
+} // namespace detail
+
+/// A read-only private mapping of a whole file, released on destruction.
+class MappedFile {
+public:
+  explicit MappedFile(const std::string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      detail::throwErrno("cannot open", path, errno);
+    }
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+      int err = errno;
+      ::close(fd);
+      detail::throwErrno("cannot stat", path, err);
+    }
+    size_ = static_cast<size_t>(st.st_size);
+
+    if (size_ > 0) {
+      void *addr = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (addr == MAP_FAILED) {
+        int err = errno;
+        ::close(fd);
+        detail::throwErrno("cannot map", path, err);
+      }
+      data_ = static_cast<const char *>(addr);
+      ::madvise(addr, size_, MADV_SEQUENTIAL);
+    }
+    ::close(fd);
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  ~MappedFile() {
+    if (data_ != nullptr) {
+      ::munmap(const_cast<char *>(data_), size_);
+    }
+  }
+
+  const char *data() const noexcept { return data_; }
+  size_t size() const noexcept { return size_; }
+
+private:
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+};
+
+/// A msgpack::packer stream backed by a shared, writable mapping of a file.
+/// Output goes to a temporary file next to `path`, whose blocks are
+/// allocated with posix_fallocate as the mapping fills, so a full disk is an
+/// error from write() rather than a SIGBUS on a store into the mapping.
+/// finish() cuts the file to the bytes written and renames it over `path`;
+/// if it is never reached the temporary file is removed and `path` is left
+/// untouched.  No heap buffer ever holds the whole output.
+class MappedOutputFile {
+public:
+  static constexpr size_t initial_capacity = size_t{1} << 20;
+
+  explicit MappedOutputFile(const std::string &path)
+      : path_(path), temp_path_(path + ".XXXXXX") {
+    fd_ = ::mkostemp(temp_path_.data(), O_CLOEXEC);
+    if (fd_ < 0) {
+      detail::throwErrno("cannot create temporary file for", path_, errno);
+    }
+    // mkostemp creates the file 0600; give it the mode open() would have.
+    if (::fchmod(fd_, 0666 & ~detail::currentUmask()) != 0) {
+      discard("cannot set mode of", fd_);
+    }
+  }
+
+  MappedOutputFile(const MappedOutputFile &) = delete;
+  MappedOutputFile &operator=(const MappedOutputFile &) = delete;
+
+  ~MappedOutputFile() {
+    if (fd_ >= 0) {
+      unmap();
+      ::close(fd_);
+      ::unlink(temp_path_.c_str());
+    }
+  }
+
+  void write(const char *buf, size_t len) {
+    if (len > capacity_ - size_) {
+      grow(size_ + len);
+    }
+    memcpy(data_ + size_, buf, len);
+    size_ += len;
+  }
+
+  size_t size() const noexcept { return size_; }
+
+  /// Unmap, cut the file to the bytes actually written and move it into
+  /// place.
+  void finish() {
+    unmap();
+    int fd = std::exchange(fd_, -1);
+    if (::ftruncate(fd, static_cast<off_t>(size_)) != 0) {
+      discard("cannot truncate", fd);
+    }
+    if (::close(fd) != 0) {
+      discard("cannot close", -1);
+    }
+    if (::rename(temp_path_.c_str(), path_.c_str()) != 0) {
+      discard("cannot rename output to", -1);
+    }
+  }
+
+private:
+  void unmap() noexcept {
+    if (data_ != nullptr) {
+      ::munmap(data_, capacity_);
+      data_ = nullptr;
+    }
+  }
+
+  [[noreturn]] void discard(const char *what, int fd) {
+    int err = errno;
+    if (fd >= 0) {
+      ::close(fd);
+    }
+    ::unlink(temp_path_.c_str());
+    detail::throwErrno(what, path_, err);
+  }
+
+  void grow(size_t needed) {
+    size_t capacity = std::max(initial_capacity, capacity_);
+    while (capacity < needed) {
+      capacity *= 2;
+    }
+
+    // posix_fallocate returns the error rather than setting errno.
+    if (int err = ::posix_fallocate(fd_, static_cast<off_t>(capacity_),
+                                    static_cast<off_t>(capacity - capacity_));
+        err != 0) {
+      detail::throwErrno("cannot grow", path_, err);
+    }
+    unmap();
+    void *addr =
+        ::mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (addr == MAP_FAILED) {
+      detail::throwErrno("cannot map", path_, errno);
+    }
+    data_ = static_cast<char *>(addr);
+    capacity_ = capacity;
+  }
+
+  std::string path_;
+  std::string temp_path_;
+  int fd_ = -1;
+  char *data_ = nullptr;
+  size_t size_ = 0;
+  size_t capacity_ = 0;
+};
+
+} // namespace guile_mmap
@@ -0,0 +1,222 @@
+#include "guile_malloc_count.hpp"
+#include "guile_object.hpp"
+#include "guile_pack.hpp"
+#include "guile_unpack.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <msgpack.hpp>
+
+// Allocation accounting for the pack and unpack paths.  C heap allocations
+// are counted by interposing malloc (guile_malloc_count.hpp); GC heap
+// allocation is read from Guile's gc-stats.  Every corpus shape has a budget
+// of allocations and GC bytes per document, and exceeding any budget fails
+// the test.
+//
+// GC byte counts are only updated when a thread's free lists are refilled,
+// so they are measured over a whole corpus and averaged.
+
+using guile_malloc_count::allocations;
+using guile_malloc_count::counting;
+
+namespace {
+
+constexpr guile_pack::flags_type test_pack_flags =
+    guile_pack::pack_flags::override_unknowns |
+    guile_pack::pack_flags::unknown_is_nil;
+
+constexpr size_t documents_per_shape = 2000;
+
+struct budget {
+  double pack_allocations;
+  double pack_gc_bytes;
+  double unpack_allocations;
+  double unpack_gc_bytes;
+};
+
+struct shape {
+  const char *name;
+  std::function<SCM(size_t)> make;
+  budget limit;
+};
+
+size_t gcBytesAllocated() {
+  static SCM key = scm_permanent_object(
+      scm_from_utf8_symbol("heap-total-allocated"));
+  SCM entry = scm_assq(key, scm_gc_stats());
+  return scm_is_pair(entry) ? scm_to_size_t(SCM_CDR(entry)) : 0;
+}
+
+/// Counts C heap allocations and GC bytes over a scope.
+struct probe {
+  size_t gc_start = gcBytesAllocated();
+  size_t allocations_start;
+
+  probe() {
+    allocations_start = allocations;
+    counting = true;
+  }
+
+  void finish(double documents, double &per_doc_allocations,
+              double &per_doc_gc_bytes) {
+    counting = false;
+    per_doc_allocations = (allocations - allocations_start) / documents;
+    per_doc_gc_bytes = (gcBytesAllocated() - gc_start) / documents;
+  }
+};
+
+bool check(const char *shape_name, const char *what, double measured,
+           double limit) {
+  bool ok = measured <= limit;
+  std::printf("%-16s %-20s %10.2f / %-10.2f %s\n", shape_name, what, measured,
+              limit, ok ? "ok" : "OVER BUDGET");
+  return ok;
+}
+
+SCM symbolList(size_t n, size_t seed) {
+  SCM list = SCM_EOL;
+  for (size_t i = 0; i < n; i++) {
+    std::string name = "sym-" + std::to_string((seed + i) % 50);
+    list = scm_cons(scm_from_utf8_symbol(name.c_str()), list);
+  }
+  return list;
+}
+
+SCM fixnumList(size_t n) {
+  SCM list = SCM_EOL;
+  for (size_t i = 0; i < n; i++) {
+    list = scm_cons(scm_from_size_t(i), list);
+  }
+  return list;
+}
+
+SCM stringTable(size_t n, size_t seed) {
+  SCM ht = scm_c_make_hash_table(n);
+  for (size_t i = 0; i < n; i++) {
+    std::string key = "key-" + std::to_string(i);
+    scm_hash_set_x(ht, scm_from_utf8_string(key.c_str()),
+                   scm_from_size_t(seed + i));
+  }
+  return ht;
+}
+
+std::vector<shape> shapes() {
+  SCM make_entry = scm_c_eval_string(R"END(
+(begin
+  (define-record-type entry
+    (make-entry name owner path note)
+    entry?
+    (name entry-name) (owner entry-owner) (path entry-path) (note entry-note))
+  make-entry)
+)END");
+
+  // Budgets leave headroom over the current counts; tighten them when an
+  // allocation is removed.  Unpacking allocates a zone and its first chunk
+  // per document.
+  return {
+      {"fixnum", [](size_t i) { return scm_from_size_t(i); },
+       {0, 16, 3, 16}},
+      {"short-string",
+       [](size_t i) {
+         return scm_from_utf8_string(("s" + std::to_string(i)).c_str());
+       },
+       {1, 64, 3, 256}},
+      {"fixnum-list", [](size_t) { return fixnumList(100); },
+       {8, 64, 3, 2048}},
+      {"symbol-list", [](size_t i) { return symbolList(20, i); },
+       {28, 2048, 3, 8192}},
+      {"string-table", [](size_t i) { return stringTable(16, i); },
+       {64, 256, 3, 8192}},
+      {"record",
+       [make_entry](size_t i) {
+         std::string n = std::to_string(i);
+         return scm_call_4(make_entry, scm_from_utf8_string(n.c_str()),
+                           scm_from_utf8_string("owner"),
+                           scm_from_utf8_string("/var/lib/entry"),
+                           scm_from_utf8_string("note"));
+       },
+       {6, 256, 3, 4096}},
+  };
+}
+
+bool runShape(const shape &s) {
+  SCM docs = scm_c_make_vector(documents_per_shape, SCM_BOOL_F);
+  for (size_t i = 0; i < documents_per_shape; i++) {
+    SCM_SIMPLE_VECTOR_SET(docs, i, s.make(i));
+  }
+
+  // A warm-up pass sizes the buffer and fills the per-vtable caches, so the
+  // measured passes see only steady-state allocations.
+  msgpack::sbuffer packed(1 << 20);
+  std::vector<size_t> offsets(documents_per_shape + 1);
+  auto packAll = [&]() {
+    packed.clear();
+    msgpack::packer<msgpack::sbuffer> packer(packed);
+    for (size_t i = 0; i < documents_per_shape; i++) {
+      offsets[i] = packed.size();
+      guile_pack::packDocument(SCM_SIMPLE_VECTOR_REF(docs, i), packer,
+                               test_pack_flags);
+    }
+    offsets[documents_per_shape] = packed.size();
+  };
+  packAll();
+
+  budget measured{};
+  {
+    probe p;
+    packAll();
+    p.finish(documents_per_shape, measured.pack_allocations,
+             measured.pack_gc_bytes);
+  }
+
+  SCM results = scm_c_make_vector(documents_per_shape, SCM_BOOL_F);
+  {
+    probe p;
+    for (size_t i = 0; i < documents_per_shape; i++) {
+      msgpack::object_handle handle;
+      msgpack::unpack(handle, packed.data() + offsets[i],
+                      offsets[i + 1] - offsets[i],
+                      guile_shared::detail::referenceAll);
+      SCM_SIMPLE_VECTOR_SET(results, i,
+                            guile_unpack::unpackDocument(handle.get(), 0));
+    }
+    p.finish(documents_per_shape, measured.unpack_allocations,
+             measured.unpack_gc_bytes);
+  }
+
+  bool ok = true;
+  if (GUILE_MALLOC_COUNT_INTERPOSED) {
+    ok &= check(s.name, "pack allocations", measured.pack_allocations,
+                s.limit.pack_allocations);
+  }
+  ok &= check(s.name, "pack GC bytes", measured.pack_gc_bytes,
+              s.limit.pack_gc_bytes);
+  if (GUILE_MALLOC_COUNT_INTERPOSED) {
+    ok &= check(s.name, "unpack allocations", measured.unpack_allocations,
+                s.limit.unpack_allocations);
+  }
+  ok &= check(s.name, "unpack GC bytes", measured.unpack_gc_bytes,
+              s.limit.unpack_gc_bytes);
+
+  scm_remember_upto_here_2(docs, results);
+  return ok;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  scm_init_guile();
+
+  if (!GUILE_MALLOC_COUNT_INTERPOSED) {
+    std::printf("malloc interposition needs glibc; checking GC bytes only\n");
+  }
+
+  bool ok = true;
+  for (const auto &s : shapes()) {
+    ok &= runShape(s);
+  }
+  return ok ? 0 : 1;
+}
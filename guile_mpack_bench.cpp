@@ -0,0 +1,83 @@
+#include "guile_object.hpp"
+#include "guile_pack.hpp"
+#include "guile_parallel.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+namespace {
+
+constexpr guile_pack::flags_type bench_pack_flags =
+    guile_pack::pack_flags::override_unknowns |
+    guile_pack::pack_flags::unknown_is_nil;
+
+using bench_clock = std::chrono::steady_clock;
+
+// A record shaped like the exporter payloads: a small hashtable with string,
+// integer, float and list fields.
+SCM makeRecord(size_t i) {
+  SCM ht = scm_c_make_hash_table(8);
+  scm_hash_set_x(ht, scm_from_utf8_string("id"), scm_from_size_t(i));
+  scm_hash_set_x(ht, scm_from_utf8_string("name"),
+                 scm_from_utf8_string(("record-" + std::to_string(i)).c_str()));
+  scm_hash_set_x(ht, scm_from_utf8_string("value"),
+                 scm_from_double(static_cast<double>(i) * 0.5));
+  scm_hash_set_x(ht, scm_from_utf8_string("tags"),
+                 scm_list_3(scm_from_utf8_string("alpha"),
+                            scm_from_utf8_string("beta"),
+                            scm_from_utf8_string("gamma")));
+  return ht;
+}
+
+double secondsSince(bench_clock::time_point start) {
+  return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+// Pack the same vector with 1, 2, 4, ... threads and report the speedup
+// relative to one thread.
+void benchParallelPack(size_t count, size_t rounds) {
+  SCM values = scm_c_make_vector(count, SCM_BOOL_F);
+  for (size_t i = 0; i < count; i++) {
+    SCM_SIMPLE_VECTOR_SET(values, i, makeRecord(i));
+  }
+
+  size_t max_threads = guile_parallel::WorkerPool::defaultConcurrency();
+  double base = 0;
+  for (size_t threads = 1;; threads *= 2) {
+    threads = std::min(threads, max_threads);
+
+    auto start = bench_clock::now();
+    size_t bytes = 0;
+    for (size_t r = 0; r < rounds; r++) {
+      SCM out = guile_parallel::packParallel(values, threads, true,
+                                             bench_pack_flags);
+      bytes += SCM_BYTEVECTOR_LENGTH(out);
+    }
+    double elapsed = secondsSince(start);
+    if (threads == 1) {
+      base = elapsed;
+    }
+
+    std::printf("parallel-pack threads=%zu objects/s=%.0f MB/s=%.1f "
+                "speedup=%.2f\n",
+                threads, count * rounds / elapsed, bytes / elapsed / 1e6,
+                base / elapsed);
+
+    if (threads == max_threads) {
+      break;
+    }
+  }
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  scm_init_guile();
+
+  size_t count = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 50000;
+  size_t rounds = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 5;
+
+  benchParallelPack(count, rounds);
+  return 0;
+}
@@ -0,0 +1,382 @@
+#include "guile_malloc_count.hpp"
+#include "guile_object.hpp"
+#include "guile_pack.hpp"
+#include "guile_scan.hpp"
+#include "guile_unpack.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <msgpack.hpp>
+
+// Pack and unpack throughput over generated corpora.  Each corpus is a
+// vector of documents; every document is packed and unpacked on its own and
+// timed individually.  Output is one JSON object per line per corpus and
+// direction so that runs can be diffed between releases.  Objects are
+// counted on the msgpack side, containers included; allocations are C heap
+// allocations per document, counted by interposing malloc.  A final set of
+// lines compares vector and list decoding of a million-element array.
+
+namespace {
+
+constexpr guile_pack::flags_type bench_pack_flags =
+    guile_pack::pack_flags::override_unknowns |
+    guile_pack::pack_flags::unknown_is_nil;
+
+using bench_clock = std::chrono::steady_clock;
+
+struct corpus {
+  const char *name;
+  SCM documents;
+};
+
+// A fixed seed keeps the corpora identical from run to run.
+struct rng {
+  uint64_t state = 0x9e3779b97f4a7c15ull;
+  uint64_t next() {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+  }
+  size_t below(size_t n) { return next() % n; }
+};
+
+// Corpora are held in a std::vector, which the collector does not scan, so
+// each one is protected for the life of the process.
+SCM makeDocuments(size_t count, const std::function<SCM(size_t)> &make) {
+  SCM docs = scm_gc_protect_object(scm_c_make_vector(count, SCM_BOOL_F));
+  for (size_t i = 0; i < count; i++) {
+    SCM_SIMPLE_VECTOR_SET(docs, i, make(i));
+  }
+  return docs;
+}
+
+// Lists nested `depth` levels deep, with a few integers at every level.
+SCM deepList(size_t depth) {
+  SCM list = SCM_EOL;
+  for (size_t d = 0; d < depth; d++) {
+    list = scm_list_4(scm_from_size_t(d), list, scm_from_size_t(d * 2),
+                      scm_from_size_t(d * 3));
+  }
+  return list;
+}
+
+SCM wideHashtable(size_t width, size_t seed) {
+  SCM ht = scm_c_make_hash_table(width);
+  for (size_t i = 0; i < width; i++) {
+    std::string key = "key-" + std::to_string(seed) + "-" + std::to_string(i);
+    scm_hash_set_x(ht, scm_from_utf8_string(key.c_str()), scm_from_size_t(i));
+  }
+  return ht;
+}
+
+// Code-like s-expressions drawn from a small pool of symbols and keywords.
+SCM sexpr(rng &r, size_t depth) {
+  static const char *const names[] = {
+      "define", "lambda", "let",  "if",    "cond", "car",  "cdr",
+      "cons",   "map",    "fold", "apply", "list", "quote", "else"};
+  constexpr size_t n_names = sizeof(names) / sizeof(names[0]);
+
+  if (depth == 0 || r.below(4) == 0) {
+    switch (r.below(3)) {
+    case 0:
+      return scm_from_utf8_symbol(names[r.below(n_names)]);
+    case 1:
+      return scm_symbol_to_keyword(
+          scm_from_utf8_symbol(names[r.below(n_names)]));
+    default:
+      return scm_from_size_t(r.below(1000));
+    }
+  }
+
+  SCM list = SCM_EOL;
+  for (size_t i = 1 + r.below(5); i > 0; i--) {
+    list = scm_cons(sexpr(r, depth - 1), list);
+  }
+  return scm_cons(scm_from_utf8_symbol(names[r.below(n_names)]), list);
+}
+
+SCM floatList(rng &r, size_t length) {
+  SCM list = SCM_EOL;
+  for (size_t i = 0; i < length; i++) {
+    list = scm_cons(scm_from_double(static_cast<double>(r.next() >> 11) /
+                                    static_cast<double>(1ull << 53)),
+                    list);
+  }
+  return list;
+}
+
+SCM randomText(rng &r, size_t length) {
+  std::string s(length, ' ');
+  for (auto &c : s) {
+    c = static_cast<char>('a' + r.below(26));
+  }
+  return scm_from_utf8_string(s.c_str());
+}
+
+SCM stringRecord(SCM make_person, rng &r) {
+  return scm_call_4(make_person, randomText(r, 12), randomText(r, 24),
+                    randomText(r, 40), randomText(r, 200));
+}
+
+SCM tinyMessage(rng &r, size_t i) {
+  switch (i % 4) {
+  case 0:
+    return scm_from_size_t(r.below(100));
+  case 1:
+    return randomText(r, 6);
+  case 2:
+    return scm_cons(scm_from_utf8_symbol("ok"), scm_from_size_t(i));
+  default:
+    return SCM_BOOL_T;
+  }
+}
+
+std::vector<corpus> makeCorpora(size_t scale) {
+  rng r;
+  SCM make_person = scm_c_eval_string(R"END(
+(begin
+  (define-record-type person
+    (make-person name email address bio)
+    person?
+    (name person-name) (email person-email)
+    (address person-address) (bio person-bio))
+  make-person)
+)END");
+
+  return {
+      {"deep-lists",
+       makeDocuments(200 * scale, [](size_t) { return deepList(200); })},
+      {"wide-hashtables", makeDocuments(20 * scale, [](size_t i) {
+         return wideHashtable(5000, i);
+       })},
+      {"symbol-sexprs",
+       makeDocuments(2000 * scale, [&](size_t) { return sexpr(r, 8); })},
+      {"float-arrays",
+       makeDocuments(200 * scale, [&](size_t) { return floatList(r, 1000); })},
+      {"string-records", makeDocuments(20000 * scale, [&](size_t) {
+         return stringRecord(make_person, r);
+       })},
+      {"tiny-messages", makeDocuments(200000 * scale, [&](size_t i) {
+         return tinyMessage(r, i);
+       })},
+  };
+}
+
+// Bytes allocated on the GC heap since startup.
+size_t gcBytesAllocated() {
+  static SCM key = scm_permanent_object(
+      scm_from_utf8_symbol("heap-total-allocated"));
+  SCM entry = scm_assq(key, scm_gc_stats());
+  return scm_is_pair(entry) ? scm_to_size_t(SCM_CDR(entry)) : 0;
+}
+
+struct measurement {
+  size_t documents = 0;
+  size_t objects = 0;
+  size_t bytes = 0;
+  double seconds = 0;
+  size_t gc_bytes = 0;
+  size_t allocations = 0;
+  std::vector<double> latencies_us;
+};
+
+/// Counts the C heap allocations made on this thread over a scope.
+struct allocation_probe {
+  size_t start = guile_malloc_count::allocations;
+
+  allocation_probe() { guile_malloc_count::counting = true; }
+
+  size_t finish() {
+    guile_malloc_count::counting = false;
+    return guile_malloc_count::allocations - start;
+  }
+};
+
+// msgpack objects in the documents at data[0, len).
+size_t countObjects(const char *data, size_t len) {
+  size_t objects = 0;
+  for (size_t pos = 0; pos < len;) {
+    guile_scan::summary s =
+        guile_scan::validate(data, len, pos, guile_scan::limits{});
+    objects += s.objects;
+    pos = s.end;
+  }
+  return objects;
+}
+
+double percentile(std::vector<double> &sorted, double p) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  size_t i = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+  return sorted[i];
+}
+
+void report(const char *corpus_name, const char *op, measurement &m) {
+  std::sort(m.latencies_us.begin(), m.latencies_us.end());
+  std::printf("{\"corpus\":\"%s\",\"op\":\"%s\",\"documents\":%zu,"
+              "\"objects\":%zu,\"bytes\":%zu,\"seconds\":%.6f,"
+              "\"mb_per_s\":%.2f,\"documents_per_s\":%.0f,"
+              "\"objects_per_s\":%.0f,\"p50_us\":%.3f,\"p90_us\":%.3f,"
+              "\"p99_us\":%.3f,\"gc_bytes_per_op\":%.1f,"
+              "\"allocs_per_op\":%.2f,\"malloc_counted\":%s}\n",
+              corpus_name, op, m.documents, m.objects, m.bytes, m.seconds,
+              m.bytes / m.seconds / 1e6, m.documents / m.seconds,
+              m.objects / m.seconds, percentile(m.latencies_us, 0.50),
+              percentile(m.latencies_us, 0.90),
+              percentile(m.latencies_us, 0.99),
+              static_cast<double>(m.gc_bytes) / m.documents,
+              static_cast<double>(m.allocations) / m.documents,
+              GUILE_MALLOC_COUNT_INTERPOSED ? "true" : "false");
+}
+
+void benchCorpus(const corpus &c, size_t rounds) {
+  size_t count = SCM_SIMPLE_VECTOR_LENGTH(c.documents);
+  // All documents of a round are packed back to back into one buffer; the
+  // last round's output is what the unpack pass decodes.
+  msgpack::sbuffer packed;
+  std::vector<size_t> offsets(count + 1);
+
+  measurement pack;
+  pack.latencies_us.reserve(count * rounds);
+  size_t gc_start = gcBytesAllocated();
+  allocation_probe pack_allocs;
+  auto start = bench_clock::now();
+  for (size_t r = 0; r < rounds; r++) {
+    packed.clear();
+    msgpack::packer<msgpack::sbuffer> packer(packed);
+    for (size_t i = 0; i < count; i++) {
+      offsets[i] = packed.size();
+      auto t0 = bench_clock::now();
+      guile_pack::packDocument(SCM_SIMPLE_VECTOR_REF(c.documents, i), packer,
+                               bench_pack_flags);
+      pack.latencies_us.push_back(
+          std::chrono::duration<double, std::micro>(bench_clock::now() - t0)
+              .count());
+    }
+    offsets[count] = packed.size();
+    pack.bytes += packed.size();
+  }
+  pack.seconds =
+      std::chrono::duration<double>(bench_clock::now() - start).count();
+  pack.allocations = pack_allocs.finish();
+  pack.gc_bytes = gcBytesAllocated() - gc_start;
+  pack.documents = count * rounds;
+  pack.objects = countObjects(packed.data(), packed.size()) * rounds;
+  report(c.name, "pack", pack);
+
+  measurement unpack;
+  unpack.latencies_us.reserve(count * rounds);
+  gc_start = gcBytesAllocated();
+  allocation_probe unpack_allocs;
+  start = bench_clock::now();
+  for (size_t r = 0; r < rounds; r++) {
+    for (size_t i = 0; i < count; i++) {
+      auto t0 = bench_clock::now();
+      msgpack::object_handle handle;
+      msgpack::unpack(handle, packed.data() + offsets[i],
+                      offsets[i + 1] - offsets[i],
+                      guile_shared::detail::referenceAll);
+      scm_remember_upto_here_1(guile_unpack::unpackDocument(handle.get(), 0));
+      unpack.latencies_us.push_back(
+          std::chrono::duration<double, std::micro>(bench_clock::now() - t0)
+              .count());
+    }
+    unpack.bytes += packed.size();
+  }
+  unpack.seconds =
+      std::chrono::duration<double>(bench_clock::now() - start).count();
+  unpack.allocations = unpack_allocs.finish();
+  unpack.gc_bytes = gcBytesAllocated() - gc_start;
+  unpack.documents = count * rounds;
+  unpack.objects = pack.objects;
+  report(c.name, "unpack", unpack);
+}
+
+// Decoding one million-element array three ways: to a vector, to a list
+// built with one scm_cons per element, and to a list whose pairs come from
+// the bulk allocator behind arrays_as_lists.
+bool benchListDecode(size_t rounds) {
+  constexpr size_t length = 1000000;
+  SCM values = SCM_EOL;
+  for (size_t i = length; i-- > 0;) {
+    values = scm_cons(scm_from_size_t(i), values);
+  }
+  msgpack::sbuffer packed;
+  msgpack::packer<msgpack::sbuffer> packer(packed);
+  guile_pack::packDocument(values, packer, bench_pack_flags);
+
+  msgpack::object_handle handle;
+  msgpack::unpack(handle, packed.data(), packed.size(),
+                  guile_shared::detail::referenceAll);
+  const msgpack::object &array = handle.get();
+  if (array.type != msgpack::type::ARRAY || array.via.array.size != length) {
+    std::fprintf(stderr, "million-array: input did not pack as a %zu element "
+                         "array\n",
+                 length);
+    return false;
+  }
+  size_t objects = countObjects(packed.data(), packed.size());
+
+  auto run = [&](const char *op, const std::function<SCM()> &decode) {
+    measurement m;
+    m.latencies_us.reserve(rounds);
+    size_t gc_start = gcBytesAllocated();
+    allocation_probe allocs;
+    auto start = bench_clock::now();
+    for (size_t r = 0; r < rounds; r++) {
+      auto t0 = bench_clock::now();
+      scm_remember_upto_here_1(decode());
+      m.latencies_us.push_back(
+          std::chrono::duration<double, std::micro>(bench_clock::now() - t0)
+              .count());
+    }
+    m.seconds =
+        std::chrono::duration<double>(bench_clock::now() - start).count();
+    m.allocations = allocs.finish();
+    m.gc_bytes = gcBytesAllocated() - gc_start;
+    m.documents = rounds;
+    m.objects = objects * rounds;
+    m.bytes = packed.size() * rounds;
+    report("million-array", op, m);
+  };
+
+  run("unpack-vector",
+      [&]() { return guile_unpack::unpackDocument(array, 0); });
+  run("unpack-list-cons", [&]() {
+    SCM list = SCM_EOL;
+    for (size_t i = array.via.array.size; i-- > 0;) {
+      list = scm_cons(guile_unpack::unpackDispatch(array.via.array.ptr[i], 0),
+                      list);
+    }
+    return list;
+  });
+  run("unpack-list-bulk", [&]() {
+    return guile_unpack::unpackDocument(
+        array, static_cast<guile_unpack::flags_t>(
+                   guile_unpack::unpack_flags::arrays_as_lists));
+  });
+  scm_remember_upto_here_1(values);
+  return true;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  scm_init_guile();
+
+  size_t scale = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1;
+  size_t rounds = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 3;
+
+  std::vector<corpus> corpora = makeCorpora(std::max<size_t>(scale, 1));
+  for (const auto &c : corpora) {
+    benchCorpus(c, rounds);
+  }
+  return benchListDecode(rounds * 5) ? 0 : 1;
+}
@@ -1,16 +1,28 @@
+#include "guile_adaptor.hpp"
+#include "guile_mmap.hpp"
 #include "guile_object.hpp"
 #include "guile_pack.hpp"
+#include "guile_parallel.hpp"
+#include "guile_scan.hpp"
+#include "guile_timestamp.hpp"
 #include "guile_unpack.hpp"
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
 #include <iostream>
 #include <msgpack.hpp>
+#include <string>
 #include <sys/types.h>
+#include <vector>
 
 static msgpack::sbuffer packScm(SCM value, uint64_t flags) {
   msgpack::sbuffer buf;
   msgpack::packer<msgpack::sbuffer> packer(buf);
 
-  guile_pack::packDispatch(value, guile_object::guile_type_of(value), packer,
-                           flags);
+  guile_pack::packDocument(value, packer, flags);
 
   return buf;
 }
@@ -23,7 +35,7 @@ static void debugMpack(const msgpack::sbuffer &buffer) {
             << std::endl;
 
   // TODO
-  auto v = guile_unpack::unpackDispatch(result.get(), 0);
+  auto v = guile_unpack::unpackDocument(result.get(), 0);
 
   scm_write(v, scm_current_output_port());
 }
@@ -52,9 +64,8 @@ static void dumpScm(std::string ident, SCM v, uint64_t flags = 0) {
   std::cout << "\n" << std::endl;
 }
 
-int main(int argc, char **argv) {
-  scm_init_guile();
-
+// Packs and decodes one value of each kind and prints the result.
+static int runDump() {
   std::cout << "Start" << std::endl;
 
   dumpScm("SCM_BOOL_F", SCM_BOOL_F);
@@ -77,6 +88,71 @@ int main(int argc, char **argv) {
   ht)
 )END"));
 
+  dumpScm("RECORD", scm_c_eval_string(R"END(
+(begin
+  (define-record-type point (make-point x y) point? (x point-x) (y point-y))
+  (make-point 1 2))
+)END"));
+  dumpScm("RECORD POSITIONAL", scm_c_eval_string("(make-point 3 4)"),
+          static_cast<uint64_t>(guile_pack::pack_flags::records_positional));
+
+  dumpScm("TIMESTAMP", scm_c_eval_string(R"END(
+(begin
+  (use-modules (srfi srfi-19))
+  (make-time time-utc 500 1700000000))
+)END"));
+
+  dumpScm("HASHTABLE CANONICAL", scm_c_eval_string(R"END(
+(let ((ht (make-hash-table)))
+  (hash-set! ht "b" 2)
+  (hash-set! ht "a" 1)
+  (hash-set! ht "c" (/ 0. 0.))
+  ht)
+)END"),
+          static_cast<uint64_t>(guile_pack::pack_flags::canonical));
+
+  dumpScm("SHARED", scm_c_eval_string(R"END(
+(let ((s "shared")) (list s (list s) s))
+)END"),
+          static_cast<uint64_t>(guile_pack::pack_flags::share_structure));
+  dumpScm("CYCLIC", scm_c_eval_string(R"END(
+(let ((ht (make-hash-table)))
+  (hash-set! ht "self" ht)
+  ht)
+)END"),
+          static_cast<uint64_t>(guile_pack::pack_flags::share_structure));
+
+  dumpScm("WEAK HASHTABLE", scm_c_eval_string(R"END(
+(let ((ht (make-weak-value-hash-table)))
+  (hash-set! ht "kept" 'value)
+  ht)
+)END"));
+  dumpScm("SRFI-69 HASHTABLE", scm_c_eval_string(R"END(
+(let ((ht ((@ (srfi srfi-69) make-hash-table) equal?)))
+  ((@ (srfi srfi-69) hash-table-set!) ht "a" 1)
+  ht)
+)END"));
+  dumpScm("R6RS HASHTABLE", scm_c_eval_string(R"END(
+(let ((ht ((@ (rnrs hashtables) make-hashtable) string-hash string=?)))
+  ((@ (rnrs hashtables) hashtable-set!) ht "a" 1)
+  ht)
+)END"));
+  dumpScm("ALIST AS MAP", scm_c_eval_string("'((a . 1) (b . 2))"),
+          static_cast<uint64_t>(guile_pack::pack_flags::alist_as_map));
+
+  {
+    // Scheme values packed by msgpack-c alongside C++ data.  The array lives
+    // on the stack, where the collector can see the values.
+    std::array<guile_adaptor::scm_value, 2> values{
+        scm_from_int(1), scm_c_eval_string("'(a \"b\")")};
+    msgpack::sbuffer buf;
+    msgpack::packer<msgpack::sbuffer> packer(buf);
+    packer.pack(values);
+    std::cout << "ADAPTOR\nMpack output ";
+    debugMpack(buf);
+    std::cout << "\n" << std::endl;
+  }
+
   dumpScm("INVALID", scm_current_output_port(),
           guile_pack::pack_flags::override_unknowns |
               guile_pack::pack_flags::unknown_is_nil);
@@ -85,3 +161,537 @@ int main(int argc, char **argv) {
   //             static_cast<uint64_t>(guile_pack::pack_flags::override_unknowns));
   return 0;
 }
+
+// Bulk conversion of multi-document msgpack files.  Input files are mapped
+// and split into windows of whole documents; each window is converted on the
+// worker pool in blocks and written out in order, so memory stays bounded
+// however large the file.
+
+namespace cli {
+
+// Input converted per window, and documents per block within one.
+constexpr size_t window_bytes = size_t{64} << 20;
+constexpr size_t block_documents = 256;
+// Scheme datums read per batch by from-scheme.
+constexpr size_t read_batch = 4096;
+
+using cli_clock = std::chrono::steady_clock;
+
+struct options {
+  std::string command;
+  std::vector<std::string> paths;
+  size_t threads = guile_parallel::WorkerPool::defaultConcurrency();
+  bool canonical = false;
+};
+
+struct totals {
+  uint64_t documents = 0;
+  uint64_t objects = 0;
+  // msgpack bytes read or written, whichever side the command has.
+  uint64_t bytes = 0;
+  cli_clock::time_point start = cli_clock::now();
+};
+
+/// Converts the document at data[0, len) and appends the output.
+using convert_fn =
+    std::function<void(const char *data, size_t len, std::string &out)>;
+
+static void usage() {
+  std::fprintf(
+      stderr,
+      "usage: guile-mpack-cpp [COMMAND [OPTIONS] FILES]\n"
+      "  (no command)                  dump the encoding of sample values\n"
+      "  to-scheme IN OUT              msgpack documents to one datum per line\n"
+      "  from-scheme [-c] IN OUT       Scheme datums to msgpack documents\n"
+      "  validate IN                   check every document structurally and\n"
+      "                                that it decodes\n"
+      "  canonicalize IN OUT           re-encode every document canonically\n"
+      "options:\n"
+      "  -j N                          worker threads\n"
+      "  -c                            canonical output\n");
+}
+
+static bool parse(int argc, char **argv, options &opts) {
+  opts.command = argv[1];
+  for (int i = 2; i < argc; i++) {
+    if (std::strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      opts.threads = std::max<size_t>(1, std::strtoul(argv[++i], nullptr, 10));
+    } else if (std::strcmp(argv[i], "-c") == 0) {
+      opts.canonical = true;
+    } else {
+      opts.paths.push_back(argv[i]);
+    }
+  }
+
+  size_t wanted = opts.command == "validate" ? 1 : 2;
+  return opts.paths.size() == wanted &&
+         (opts.command == "to-scheme" || opts.command == "from-scheme" ||
+          opts.command == "validate" || opts.command == "canonicalize");
+}
+
+static void report(const options &opts, const totals &t) {
+  double seconds =
+      std::chrono::duration<double>(cli_clock::now() - t.start).count();
+  std::fprintf(stderr,
+               "%s: %llu documents, %llu objects, %.1f MB in %.3f s "
+               "(%.0f objects/s, %.1f MB/s)\n",
+               opts.command.c_str(),
+               static_cast<unsigned long long>(t.documents),
+               static_cast<unsigned long long>(t.objects), t.bytes / 1e6,
+               seconds, t.objects / seconds, t.bytes / 1e6 / seconds);
+}
+
+/// Convert every document of a mapped file, writing the outputs in input
+/// order.  Each document is validated before it is converted.
+static void convertFile(const options &opts, const convert_fn &convert,
+                        guile_mmap::MappedOutputFile *output, totals &t) {
+  guile_mmap::MappedFile input(opts.paths[0]);
+  const char *data = input.data();
+  size_t len = input.size();
+  const guile_scan::limits &limits = guile_scan::currentLimits();
+
+  std::vector<size_t> starts;
+  std::vector<std::string> block_out;
+  size_t pos = 0;
+  while (pos < len) {
+    // Find the documents of the next window.
+    starts.clear();
+    size_t window_start = pos;
+    while (pos < len && pos - window_start < window_bytes) {
+      starts.push_back(pos);
+      guile_scan::summary s = guile_scan::validate(data, len, pos, limits);
+      t.objects += s.objects;
+      pos = s.end;
+    }
+    starts.push_back(pos);
+
+    size_t count = starts.size() - 1;
+    size_t blocks = (count + block_documents - 1) / block_documents;
+    block_out.assign(blocks, std::string());
+    std::atomic<size_t> next_block{0};
+    guile_parallel::detail::FailureSlot failure;
+
+    std::function<void()> body = [&]() {
+      size_t block;
+      while (!failure.failed.load(std::memory_order_relaxed) &&
+             (block = next_block.fetch_add(1, std::memory_order_relaxed)) <
+                 blocks) {
+        size_t first = block * block_documents;
+        size_t last = std::min(count, first + block_documents);
+        for (size_t i = first; i < last; i++) {
+          convert(data + starts[i], starts[i + 1] - starts[i],
+                  block_out[block]);
+        }
+      }
+    };
+    guile_parallel::WorkerPool::instance().run(
+        std::min(opts.threads, blocks),
+        [&](size_t) { guile_parallel::detail::guardedWork(body, failure); });
+    if (failure.failed) {
+      throw std::runtime_error(failure.message);
+    }
+
+    if (output != nullptr) {
+      for (const auto &out : block_out) {
+        output->write(out.data(), out.size());
+      }
+    }
+    t.documents += count;
+  }
+  t.bytes = len;
+}
+
+static SCM decode(const char *data, size_t len) {
+  msgpack::object_handle handle;
+  msgpack::unpack(handle, data, len, guile_shared::detail::referenceAll);
+  return guile_unpack::unpackDocument(handle.get(), 0);
+}
+
+static void appendWritten(SCM value, std::string &out) {
+  size_t n;
+  std::unique_ptr<char, guile_shared::detail::malloc_deleter> text{
+      scm_to_utf8_stringn(scm_object_to_string(value, SCM_UNDEFINED), &n)};
+  out.append(text.get(), n);
+  out.push_back('\n');
+}
+
+// Appends to a std::string as a msgpack::packer stream.
+struct string_stream {
+  std::string &out;
+  void write(const char *data, size_t len) { out.append(data, len); }
+};
+
+static void toScheme(const options &opts, totals &t) {
+  guile_mmap::MappedOutputFile output(opts.paths[1]);
+  convertFile(
+      opts,
+      [](const char *data, size_t len, std::string &out) {
+        appendWritten(decode(data, len), out);
+      },
+      &output, t);
+  output.finish();
+}
+
+static void validate(const options &opts, totals &t) {
+  convertFile(
+      opts,
+      [](const char *data, size_t len, std::string &) {
+        scm_remember_upto_here_1(decode(data, len));
+      },
+      nullptr, t);
+}
+
+// Canonical re-encoding of decoded msgpack objects, following the rules
+// the canonical pack flag applies to Scheme values: integers and headers in
+// their shortest form, floats by guile_pack::canonical::canonicalDouble, and
+// map entries ordered by key bytes, then value bytes.  Ext bodies are kept
+// as they are, except that record bodies are re-encoded and compressed
+// frames are replaced by the document they hold.
+namespace canonical {
+
+template <typename T>
+void packObject(const msgpack::object &o, msgpack::packer<T> &packer,
+                uint64_t depth);
+
+/// Parse the single document in an ext body, within the current limits.
+inline msgpack::object parseBody(msgpack::zone &zone, const char *data,
+                                 size_t len) {
+  guile_scan::summary s =
+      guile_scan::validate(data, len, 0, guile_scan::currentLimits());
+  if (s.end != len) {
+    throw std::runtime_error("trailing bytes in ext body");
+  }
+  size_t off = 0;
+  return msgpack::unpack(zone, data, len, off,
+                         guile_shared::detail::referenceAll);
+}
+
+inline bool isRecordExt(int8_t type) {
+  return type == guile_shared::record_ext_id ||
+         (type >= guile_shared::record_tag_ext_id_first &&
+          static_cast<size_t>(type - guile_shared::record_tag_ext_id_first) <
+              guile_shared::record_tag_count);
+}
+
+template <typename T>
+void packExt(const msgpack::object_ext &ext, msgpack::packer<T> &packer,
+             uint64_t depth) {
+  msgpack::zone zone;
+  if (isRecordExt(ext.type())) {
+    msgpack::sbuffer body;
+    msgpack::packer<msgpack::sbuffer> body_packer(body);
+    packObject(parseBody(zone, ext.data(), ext.size), body_packer, depth);
+    packer.pack_ext(body.size(), ext.type());
+    packer.pack_ext_body(body.data(), body.size());
+    return;
+  }
+  if (ext.type() == guile_shared::compressed_ext_id) {
+    std::vector<char> doc;
+    guile_unpack::inflateFrame(ext.data(), ext.size, doc);
+    packObject(parseBody(zone, doc.data(), doc.size()), packer, depth);
+    return;
+  }
+  packer.pack_ext(ext.size, ext.type());
+  packer.pack_ext_body(ext.data(), ext.size);
+}
+
+template <typename T>
+void packMap(const msgpack::object_map &map, msgpack::packer<T> &packer,
+             uint64_t depth) {
+  struct entry {
+    size_t key_offset, key_size, value_offset, value_size;
+  };
+  // Keys and values are encoded once into one buffer; the entries are
+  // sorted on those bytes and copied out.
+  msgpack::sbuffer bytes;
+  msgpack::packer<msgpack::sbuffer> scratch(bytes);
+  std::vector<entry> entries(map.size);
+  for (uint32_t i = 0; i < map.size; i++) {
+    entry &e = entries[i];
+    e.key_offset = bytes.size();
+    packObject(map.ptr[i].key, scratch, depth);
+    e.value_offset = bytes.size();
+    packObject(map.ptr[i].val, scratch, depth);
+    e.key_size = e.value_offset - e.key_offset;
+    e.value_size = bytes.size() - e.value_offset;
+  }
+
+  auto view = [&bytes](size_t offset, size_t size) {
+    return std::string_view(bytes.data() + offset, size);
+  };
+  std::sort(entries.begin(), entries.end(),
+            [&](const entry &a, const entry &b) {
+              auto ka = view(a.key_offset, a.key_size);
+              auto kb = view(b.key_offset, b.key_size);
+              if (ka != kb) {
+                return ka < kb;
+              }
+              return view(a.value_offset, a.value_size) <
+                     view(b.value_offset, b.value_size);
+            });
+
+  packer.pack_map(map.size);
+  for (const entry &e : entries) {
+    // pack_bin_body appends its bytes to the stream unchanged.
+    packer.pack_bin_body(bytes.data() + e.key_offset, e.key_size);
+    packer.pack_bin_body(bytes.data() + e.value_offset, e.value_size);
+  }
+}
+
+template <typename T>
+void packObject(const msgpack::object &o, msgpack::packer<T> &packer,
+                uint64_t depth) {
+  // Record and frame bodies nest documents, so depth is counted across them.
+  if (++depth > guile_scan::currentLimits().max_depth) {
+    throw std::runtime_error("msgpack nesting exceeds limit");
+  }
+  switch (o.type) {
+  case msgpack::type::NIL:
+    packer.pack_nil();
+    break;
+  case msgpack::type::BOOLEAN:
+    packer.pack(o.via.boolean);
+    break;
+  case msgpack::type::POSITIVE_INTEGER:
+    packer.pack_uint64(o.via.u64);
+    break;
+  case msgpack::type::NEGATIVE_INTEGER:
+    packer.pack_int64(o.via.i64);
+    break;
+  case msgpack::type::FLOAT32:
+  case msgpack::type::FLOAT64:
+    packer.pack_double(guile_pack::canonical::canonicalDouble(o.via.f64));
+    break;
+  case msgpack::type::STR:
+    packer.pack_str(o.via.str.size);
+    packer.pack_str_body(o.via.str.ptr, o.via.str.size);
+    break;
+  case msgpack::type::BIN:
+    packer.pack_bin(o.via.bin.size);
+    packer.pack_bin_body(o.via.bin.ptr, o.via.bin.size);
+    break;
+  case msgpack::type::ARRAY:
+    packer.pack_array(o.via.array.size);
+    for (uint32_t i = 0; i < o.via.array.size; i++) {
+      packObject(o.via.array.ptr[i], packer, depth);
+    }
+    break;
+  case msgpack::type::MAP:
+    packMap(o.via.map, packer, depth);
+    break;
+  case msgpack::type::EXT:
+    packExt(o.via.ext, packer, depth);
+    break;
+  }
+}
+
+} // namespace canonical
+
+/// Re-encode every document canonically.  Documents are canonicalized as
+/// msgpack objects, so nothing is lost to the Scheme mapping; those with
+/// shared structure are expanded by decoding and repacking them, since
+/// reordering map entries could move a reference ahead of its definition.
+static void canonicalize(const options &opts, totals &t) {
+  guile_mmap::MappedOutputFile output(opts.paths[1]);
+  convertFile(
+      opts,
+      [](const char *data, size_t len, std::string &out) {
+        string_stream stream{out};
+        msgpack::packer<string_stream> packer(stream);
+        if (guile_parallel::detail::hasSharedStructure(data, len)) {
+          guile_pack::packDocument(decode(data, len), packer,
+                                   guile_pack::pack_flags::canonical |
+                                       guile_pack::pack_flags::ext_pairs);
+          return;
+        }
+        msgpack::object_handle handle;
+        msgpack::unpack(handle, data, len, guile_shared::detail::referenceAll);
+        canonical::packObject(handle.get(), packer, 0);
+      },
+      &output, t);
+  output.finish();
+}
+
+static void closePort(SCM port) { scm_close_port(port); }
+
+/// Read datums in batches and pack each batch on the worker pool.
+static void fromScheme(const options &opts, totals &t) {
+  // A datum with no msgpack form is an error rather than a nil.  Exts are
+  // read back in the (type . bytevector) form to-scheme writes them in.
+  guile_pack::flags_type flags =
+      static_cast<guile_pack::flags_type>(guile_pack::pack_flags::ext_pairs);
+  if (opts.canonical) {
+    flags = flags | guile_pack::pack_flags::canonical;
+  }
+  // The port is closed however the function is left, and a read error
+  // still removes the temporary output file.
+  guile_shared::unwind_scope scope;
+  SCM port = scm_open_file(scm_from_utf8_string(opts.paths[0].c_str()),
+                           scm_from_utf8_string("r"));
+  scm_dynwind_unwind_handler_with_scm(closePort, port, SCM_F_WIND_EXPLICITLY);
+  guile_mmap::MappedOutputFile output(opts.paths[1]);
+  scope.destroy(output);
+  const guile_scan::limits &limits = guile_scan::currentLimits();
+
+  SCM batch = scm_c_make_vector(read_batch, SCM_BOOL_F);
+  bool eof = false;
+  while (!eof) {
+    size_t n = 0;
+    for (; n < read_batch; n++) {
+      SCM datum = scm_read(port);
+      if (SCM_EOF_OBJECT_P(datum)) {
+        eof = true;
+        break;
+      }
+      SCM_SIMPLE_VECTOR_SET(batch, n, datum);
+    }
+    if (n == 0) {
+      break;
+    }
+
+    SCM values = batch;
+    if (n != read_batch) {
+      values = scm_c_make_vector(n, SCM_BOOL_F);
+      for (size_t i = 0; i < n; i++) {
+        SCM_SIMPLE_VECTOR_SET(values, i, SCM_SIMPLE_VECTOR_REF(batch, i));
+      }
+    }
+    SCM packed = guile_parallel::packParallel(values, opts.threads, true, flags);
+    const char *data = (const char *)SCM_BYTEVECTOR_CONTENTS(packed);
+    size_t len = SCM_BYTEVECTOR_LENGTH(packed);
+    for (size_t pos = 0; pos < len;) {
+      guile_scan::summary s = guile_scan::validate(data, len, pos, limits);
+      t.objects += s.objects;
+      pos = s.end;
+    }
+    output.write(data, len);
+    t.documents += n;
+    t.bytes += len;
+  }
+
+  output.finish();
+}
+
+static void runCommand(const options &opts, totals &t) {
+  if (opts.command == "to-scheme") {
+    toScheme(opts, t);
+  } else if (opts.command == "from-scheme") {
+    fromScheme(opts, t);
+  } else if (opts.command == "validate") {
+    validate(opts, t);
+  } else {
+    canonicalize(opts, t);
+  }
+}
+
+} // namespace cli
+
+// Arrays, bin and an unknown ext must come back unchanged from canonicalize
+// and from a decode and canonical repack, and a value with no msgpack form
+// must fail to pack.
+static int runRoundTrip() {
+  const char bin[] = {0, 1, 2};
+  const int8_t ext_type = 42;
+  auto packDoc = [&](msgpack::packer<msgpack::sbuffer> &p, bool sorted) {
+    p.pack_array(3);
+    p.pack_map(3);
+    auto packB = [&]() {
+      p.pack(std::string("b"));
+      p.pack_array(3);
+      p.pack(1);
+      p.pack(-2);
+      p.pack_array(1);
+      p.pack(3);
+    };
+    if (!sorted) {
+      packB();
+    }
+    p.pack(std::string("a"));
+    p.pack_bin(sizeof bin);
+    p.pack_bin_body(bin, sizeof bin);
+    if (sorted) {
+      packB();
+    }
+    p.pack(std::string("c"));
+    p.pack_ext(2, ext_type);
+    p.pack_ext_body("xy", 2);
+    p.pack_bin(sizeof bin);
+    p.pack_bin_body(bin, sizeof bin);
+    p.pack_ext(2, ext_type);
+    p.pack_ext_body("xy", 2);
+  };
+  msgpack::sbuffer input, expected;
+  msgpack::packer<msgpack::sbuffer> input_packer(input);
+  msgpack::packer<msgpack::sbuffer> expected_packer(expected);
+  packDoc(input_packer, false);
+  packDoc(expected_packer, true);
+  auto same = [&expected](const std::string &out) {
+    return out == std::string_view(expected.data(), expected.size());
+  };
+
+  bool ok = true;
+  std::string out;
+  {
+    msgpack::object_handle handle;
+    msgpack::unpack(handle, input.data(), input.size());
+    cli::string_stream stream{out};
+    msgpack::packer<cli::string_stream> packer(stream);
+    cli::canonical::packObject(handle.get(), packer, 0);
+  }
+  std::cout << "ROUND TRIP canonicalize " << (same(out) ? "ok" : "FAILED")
+            << std::endl;
+  ok &= same(out);
+
+  out.clear();
+  {
+    cli::string_stream stream{out};
+    msgpack::packer<cli::string_stream> packer(stream);
+    guile_pack::packDocument(cli::decode(input.data(), input.size()), packer,
+                             guile_pack::pack_flags::canonical |
+                                 guile_pack::pack_flags::ext_pairs);
+  }
+  std::cout << "ROUND TRIP scheme " << (same(out) ? "ok" : "FAILED")
+            << std::endl;
+  ok &= same(out);
+
+  bool threw = false;
+  try {
+    packScm(scm_current_output_port(), 0);
+  } catch (const guile_pack::pack_error &) {
+    threw = true;
+  }
+  std::cout << "ROUND TRIP unpackable " << (threw ? "ok" : "FAILED")
+            << std::endl;
+  ok &= threw;
+  return ok ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+  scm_init_guile();
+  guile_timestamp::install();
+
+  if (argc < 2) {
+    int status = runDump();
+    return status != 0 ? status : runRoundTrip();
+  }
+
+  cli::options opts;
+  if (!cli::parse(argc, argv, opts)) {
+    cli::usage();
+    return 2;
+  }
+
+  // Scheme errors, such as unreadable input, are caught along with C++
+  // exceptions.
+  cli::totals t;
+  guile_parallel::detail::FailureSlot failure;
+  std::function<void()> body = [&]() { cli::runCommand(opts, t); };
+  guile_parallel::detail::guardedWork(body, failure);
+  if (failure.failed) {
+    std::fprintf(stderr, "%s: %s\n", opts.command.c_str(),
+                 failure.message.c_str());
+    return 1;
+  }
+  cli::report(opts, t);
+  return 0;
+}
@@ -0,0 +1,166 @@
+#include "guile_object.hpp"
+#include "guile_pack.hpp"
+#include "guile_record.hpp"
+#include "guile_unpack.hpp"
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <msgpack.hpp>
+
+// Round trips through the pack and unpack paths.  Each case checks the
+// bytes a value packs to against msgpack-c's own encoding of the expected
+// document, and that decoding them gives back an equal? value.
+
+namespace {
+
+using guile_pack::pack_flags;
+
+std::string packBytes(SCM value, guile_pack::flags_type flags) {
+  msgpack::sbuffer buf;
+  msgpack::packer<msgpack::sbuffer> packer(buf);
+  guile_pack::packDocument(value, packer, flags);
+  return std::string(buf.data(), buf.size());
+}
+
+SCM unpackBytes(const std::string &bytes, guile_unpack::flags_t flags) {
+  msgpack::object_handle handle;
+  msgpack::unpack(handle, bytes.data(), bytes.size(),
+                  guile_shared::detail::referenceAll);
+  return guile_unpack::unpackDocument(handle.get(), flags);
+}
+
+/// msgpack-c's encoding of the document written by fn.
+std::string expected(
+    const std::function<void(msgpack::packer<msgpack::sbuffer> &)> &fn) {
+  msgpack::sbuffer buf;
+  msgpack::packer<msgpack::sbuffer> packer(buf);
+  fn(packer);
+  return std::string(buf.data(), buf.size());
+}
+
+bool check(const char *name, bool ok) {
+  std::printf("%-40s %s\n", name, ok ? "ok" : "FAILED");
+  return ok;
+}
+
+/// value packs to `bytes` with `flags` and decodes back to an equal? value.
+bool roundTrip(const char *name, const char *expr, guile_pack::flags_type flags,
+               const std::string &bytes) {
+  SCM value = scm_c_eval_string(expr);
+  std::string packed = packBytes(value, flags);
+  bool ok = check(name, packed == bytes);
+  SCM decoded = unpackBytes(packed, 0);
+  std::string what = std::string(name) + " decodes equal";
+  ok &= check(what.c_str(), scm_is_true(scm_equal_p(decoded, value)));
+  return ok;
+}
+
+bool vectors() {
+  bool ok = roundTrip("vector as array", "#(1 \"a\" #(2))", 0,
+                      expected([](auto &p) {
+                        p.pack_array(3);
+                        p.pack(1);
+                        p.pack(std::string("a"));
+                        p.pack_array(1);
+                        p.pack(2);
+                      }));
+  ok &= roundTrip("empty vector", "#()", 0,
+                  expected([](auto &p) { p.pack_array(0); }));
+
+  // Shared and cyclic vectors are written once and referenced after that.
+  auto share = static_cast<guile_pack::flags_type>(pack_flags::share_structure);
+  SCM shared = unpackBytes(
+      packBytes(scm_c_eval_string("(let ((v (vector 1 2))) (vector v v))"),
+                share),
+      0);
+  ok &= check("shared vector decodes eq?",
+              scm_is_eq(scm_c_vector_ref(shared, 0),
+                        scm_c_vector_ref(shared, 1)));
+  SCM cyclic = unpackBytes(
+      packBytes(scm_c_eval_string(
+                    "(let ((v (vector 1 #f))) (vector-set! v 1 v) v)"),
+                share),
+      0);
+  ok &= check("cyclic vector decodes to itself",
+              scm_is_eq(scm_c_vector_ref(cyclic, 1), cyclic));
+  return ok;
+}
+
+bool bytevectors() {
+  const char body[] = {0, 1, '\xff'};
+  bool ok = roundTrip("bytevector as bin", "#vu8(0 1 255)", 0,
+                      expected([&](auto &p) {
+                        p.pack_bin(sizeof body);
+                        p.pack_bin_body(body, sizeof body);
+                      }));
+  ok &= roundTrip("empty bytevector", "#vu8()", 0,
+                  expected([](auto &p) { p.pack_bin(0); }));
+  return ok;
+}
+
+/// Canonical floats: one NaN, no negative zero, always float64.
+bool canonicalFloats() {
+  auto canonical = static_cast<guile_pack::flags_type>(pack_flags::canonical);
+  std::string zero = expected([](auto &p) { p.pack_double(0.0); });
+  bool ok = check("canonical -0.0 packs as 0.0",
+                  packBytes(scm_from_double(-0.0), canonical) == zero);
+  ok &= check("canonical NaNs pack alike",
+              packBytes(scm_c_eval_string("(/ 0. 0.)"), canonical) ==
+                  packBytes(scm_c_eval_string("(- (/ 0. 0.))"), canonical));
+  ok &= check("plain -0.0 keeps its sign",
+              packBytes(scm_from_double(-0.0), 0) != zero);
+  return ok;
+}
+
+/// (type . bytevector) pairs become exts only when asked to.
+bool extPairs() {
+  const char *expr = "(cons 42 #vu8(120 121))";
+  auto ext_pairs = static_cast<guile_pack::flags_type>(pack_flags::ext_pairs);
+  std::string ext = expected([](auto &p) {
+    p.pack_ext(2, 42);
+    p.pack_ext_body("xy", 2);
+  });
+  bool ok = roundTrip("ext pair as ext", expr, ext_pairs, ext);
+  ok &= check("ext pair without the flag",
+              packBytes(scm_c_eval_string(expr), 0) != ext);
+  return ok;
+}
+
+/// A record that refers to itself is claimed before its fields decode.
+bool cyclicRecords() {
+  SCM node = scm_c_eval_string(R"END(
+(begin
+  (define-record-type node (make-node value next) node?
+    (value node-value) (next node-next set-node-next!))
+  (let ((n (make-node 1 #f)))
+    (set-node-next! n n)
+    n))
+)END");
+  guile_record::registerRecord(scm_c_eval_string("node"), 0, SCM_UNDEFINED);
+  SCM decoded = unpackBytes(
+      packBytes(node, static_cast<guile_pack::flags_type>(
+                          pack_flags::share_structure)),
+      0);
+  SCM next = scm_call_1(scm_c_eval_string("node-next"), decoded);
+  SCM value = scm_call_1(scm_c_eval_string("node-value"), decoded);
+  return check("cyclic record decodes to itself",
+               scm_is_eq(next, decoded) &&
+                   scm_is_eq(value, scm_from_int(1)));
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  scm_init_guile();
+
+  bool ok = true;
+  ok &= vectors();
+  ok &= bytevectors();
+  ok &= canonicalFloats();
+  ok &= extPairs();
+  ok &= cyclicRecords();
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,166 @@
+#include "guile_object.hpp"
+#include "guile_rpc.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <msgpack.hpp>
+
+// Load generator for the msgpack-RPC server.  Client threads connect over a
+// Unix socket and keep a fixed number of requests in flight each; every
+// request's round trip is timed.  Prints one JSON object with requests per
+// second and latency percentiles.
+//
+// Arguments: [clients] [requests per client] [pipeline depth]
+
+namespace {
+
+namespace asio = boost::asio;
+using protocol = asio::local::stream_protocol;
+using bench_clock = std::chrono::steady_clock;
+
+struct client_stats {
+  std::vector<double> latencies_us;
+  std::string failure;
+};
+
+void packRequest(msgpack::packer<msgpack::sbuffer> &packer, uint64_t msgid) {
+  static const std::string method = "echo";
+  static const std::string payload = "the quick brown fox";
+  packer.pack_array(4);
+  packer.pack_uint64(0);
+  packer.pack_uint64(msgid);
+  packer.pack(method);
+  packer.pack_array(2);
+  packer.pack(payload);
+  packer.pack_uint64(msgid);
+}
+
+void runClient(const std::string &path, size_t requests, size_t depth,
+               client_stats &stats) {
+  try {
+    asio::io_context io;
+    protocol::socket socket(io);
+    socket.connect(protocol::endpoint(path));
+
+    std::vector<bench_clock::time_point> sent(requests);
+    stats.latencies_us.reserve(requests);
+    msgpack::sbuffer out;
+    msgpack::packer<msgpack::sbuffer> packer(out);
+    msgpack::unpacker unpacker;
+    size_t next = 0, received = 0;
+
+    auto sendUpTo = [&](size_t limit) {
+      out.clear();
+      auto now = bench_clock::now();
+      for (; next < std::min(limit, requests); next++) {
+        sent[next] = now;
+        packRequest(packer, next);
+      }
+      if (out.size() > 0) {
+        asio::write(socket, asio::buffer(out.data(), out.size()));
+      }
+    };
+
+    sendUpTo(depth);
+    while (received < requests) {
+      unpacker.reserve_buffer(64 * 1024);
+      size_t n = socket.read_some(
+          asio::buffer(unpacker.buffer(), unpacker.buffer_capacity()));
+      unpacker.buffer_consumed(n);
+
+      auto now = bench_clock::now();
+      msgpack::object_handle handle;
+      while (unpacker.next(handle)) {
+        const msgpack::object &msg = handle.get();
+        uint64_t msgid = msg.via.array.ptr[1].via.u64;
+        if (msgid >= requests || !msg.via.array.ptr[2].is_nil()) {
+          throw std::runtime_error("bad response");
+        }
+        stats.latencies_us.push_back(
+            std::chrono::duration<double, std::micro>(now - sent[msgid])
+                .count());
+        received++;
+      }
+      sendUpTo(received + depth);
+    }
+  } catch (const std::exception &e) {
+    stats.failure = e.what();
+  }
+}
+
+double percentile(const std::vector<double> &sorted, double p) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  return sorted[static_cast<size_t>(p * (sorted.size() - 1) + 0.5)];
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  scm_init_guile();
+  guile_rpc::initServerType();
+
+  size_t clients = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 4;
+  size_t requests = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 50000;
+  size_t depth = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 32;
+  clients = std::max<size_t>(clients, 1);
+  depth = std::max<size_t>(depth, 1);
+
+  SCM server = guile_rpc::makeServer(
+      guile_pack::pack_flags::override_unknowns |
+          guile_pack::pack_flags::unknown_is_nil,
+      0);
+  guile_rpc::server_state &st = guile_rpc::stateOf(server);
+  guile_rpc::registerMethod(st, "echo", scm_c_eval_string("(lambda args args)"));
+
+  std::string path =
+      "/tmp/guile-mpack-rpc-bench-" + std::to_string(::getpid()) + ".sock";
+  guile_rpc::listenUnix(st, path);
+
+  std::vector<client_stats> stats(clients);
+  auto start = bench_clock::now();
+  std::thread driver([&]() {
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < clients; i++) {
+      threads.emplace_back(runClient, path, requests, depth,
+                           std::ref(stats[i]));
+    }
+    for (auto &t : threads) {
+      t.join();
+    }
+    guile_rpc::stop(st);
+  });
+  guile_rpc::run(st);
+  driver.join();
+  double seconds =
+      std::chrono::duration<double>(bench_clock::now() - start).count();
+  ::unlink(path.c_str());
+
+  std::vector<double> latencies;
+  for (const auto &s : stats) {
+    if (!s.failure.empty()) {
+      std::fprintf(stderr, "client failed: %s\n", s.failure.c_str());
+      return 1;
+    }
+    latencies.insert(latencies.end(), s.latencies_us.begin(),
+                     s.latencies_us.end());
+  }
+  std::sort(latencies.begin(), latencies.end());
+
+  std::printf("{\"transport\":\"unix\",\"clients\":%zu,\"depth\":%zu,"
+              "\"requests\":%zu,\"seconds\":%.6f,\"requests_per_s\":%.0f,"
+              "\"p50_us\":%.3f,\"p99_us\":%.3f}\n",
+              clients, depth, latencies.size(), seconds,
+              latencies.size() / seconds, percentile(latencies, 0.50),
+              percentile(latencies, 0.99));
+  scm_remember_upto_here_1(server);
+  return 0;
+}
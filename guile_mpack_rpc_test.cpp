@@ -0,0 +1,196 @@
+#include "guile_object.hpp"
+#include "guile_rpc.hpp"
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <msgpack.hpp>
+
+// End-to-end test of the msgpack-RPC server over a Unix socket.  The server
+// runs on the main Guile thread; a plain client thread pipelines a batch of
+// requests and a notification, split across two writes mid-message, checks
+// every response and then stops the server.
+
+namespace {
+
+namespace asio = boost::asio;
+using protocol = asio::local::stream_protocol;
+
+constexpr uint64_t add_requests = 100;
+
+struct client_result {
+  std::vector<std::string> failures;
+  size_t responses = 0;
+};
+
+void expect(client_result &r, bool ok, const std::string &what) {
+  if (!ok) {
+    r.failures.push_back(what);
+  }
+}
+
+std::string_view strOf(const msgpack::object &o) {
+  return o.type == msgpack::type::STR
+             ? std::string_view(o.via.str.ptr, o.via.str.size)
+             : std::string_view();
+}
+
+// packParams packs the params array.
+template <typename Fn>
+void request(msgpack::packer<msgpack::sbuffer> &packer, uint64_t msgid,
+             const std::string &method, Fn &&packParams) {
+  packer.pack_array(4);
+  packer.pack_uint64(0);
+  packer.pack_uint64(msgid);
+  packer.pack(method);
+  packParams();
+}
+
+/// Requests 0..99 call add, then echo, fail and a missing method.  A
+/// notification sits between them and gets no response.
+msgpack::sbuffer batch() {
+  msgpack::sbuffer buf;
+  msgpack::packer<msgpack::sbuffer> packer(buf);
+  for (uint64_t i = 0; i < add_requests; i++) {
+    request(packer, i, "add", [&]() {
+      packer.pack_array(2);
+      packer.pack_uint64(i);
+      packer.pack_uint64(2 * i);
+    });
+  }
+
+  packer.pack_array(3);
+  packer.pack_uint64(2);
+  packer.pack(std::string("note"));
+  packer.pack_array(1);
+  packer.pack_uint64(7);
+
+  request(packer, add_requests, "echo", [&]() {
+    packer.pack_array(2);
+    packer.pack(std::string("hello"));
+    packer.pack_array(2);
+    packer.pack_uint64(1);
+    packer.pack_uint64(2);
+  });
+  request(packer, add_requests + 1, "fail", [&]() { packer.pack_array(0); });
+  request(packer, add_requests + 2, "missing",
+          [&]() { packer.pack_array(0); });
+  return buf;
+}
+
+void checkResponse(client_result &r, const msgpack::object &msg) {
+  uint64_t expected_id = r.responses++;
+  std::string at = "response " + std::to_string(expected_id) + ": ";
+
+  if (msg.type != msgpack::type::ARRAY || msg.via.array.size != 4) {
+    expect(r, false, at + "not a 4 element array");
+    return;
+  }
+  const msgpack::object *f = msg.via.array.ptr;
+  expect(r, f[0].type == msgpack::type::POSITIVE_INTEGER && f[0].via.u64 == 1,
+         at + "wrong message type");
+  expect(r, f[1].via.u64 == expected_id, at + "out of order");
+
+  if (expected_id < add_requests) {
+    expect(r, f[2].is_nil(), at + "unexpected error");
+    expect(r, f[3].type == msgpack::type::POSITIVE_INTEGER &&
+                  f[3].via.u64 == 3 * expected_id,
+           at + "wrong sum");
+  } else if (expected_id == add_requests) {
+    const msgpack::object &result = f[3];
+    expect(r, f[2].is_nil(), at + "unexpected error");
+    expect(r, result.type == msgpack::type::ARRAY &&
+                  result.via.array.size == 2 &&
+                  strOf(result.via.array.ptr[0]) == "hello" &&
+                  result.via.array.ptr[1].type == msgpack::type::ARRAY,
+           at + "echo mismatch");
+  } else if (expected_id == add_requests + 1) {
+    expect(r, strOf(f[2]).find("handler failed") != std::string_view::npos,
+           at + "handler error not reported");
+    expect(r, f[3].is_nil(), at + "result set on error");
+  } else {
+    expect(r, strOf(f[2]).find("no such method") != std::string_view::npos,
+           at + "missing method not reported");
+  }
+}
+
+void runClient(const std::string &path, guile_rpc::server_state &server,
+               client_result &r) {
+  try {
+    asio::io_context io;
+    protocol::socket socket(io);
+    socket.connect(protocol::endpoint(path));
+
+    msgpack::sbuffer buf = batch();
+    // Split inside the first request so the server sees a partial message.
+    size_t split = 3;
+    asio::write(socket, asio::buffer(buf.data(), split));
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    asio::write(socket, asio::buffer(buf.data() + split, buf.size() - split));
+
+    msgpack::unpacker unpacker;
+    while (r.responses < add_requests + 3) {
+      unpacker.reserve_buffer(4096);
+      size_t n = socket.read_some(
+          asio::buffer(unpacker.buffer(), unpacker.buffer_capacity()));
+      unpacker.buffer_consumed(n);
+      msgpack::object_handle handle;
+      while (unpacker.next(handle)) {
+        checkResponse(r, handle.get());
+      }
+    }
+  } catch (const std::exception &e) {
+    r.failures.push_back(std::string("client: ") + e.what());
+  }
+  guile_rpc::stop(server);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  scm_init_guile();
+  guile_rpc::initServerType();
+
+  SCM server = guile_rpc::makeServer(
+      guile_pack::pack_flags::override_unknowns |
+          guile_pack::pack_flags::unknown_is_nil,
+      0);
+  guile_rpc::server_state &st = guile_rpc::stateOf(server);
+
+  scm_c_eval_string("(define note-total 0)");
+  guile_rpc::registerMethod(st, "add",
+                            scm_c_eval_string("(lambda (a b) (+ a b))"));
+  guile_rpc::registerMethod(st, "echo", scm_c_eval_string("(lambda args args)"));
+  guile_rpc::registerMethod(
+      st, "fail", scm_c_eval_string("(lambda () (error \"handler failed\"))"));
+  guile_rpc::registerMethod(
+      st, "note",
+      scm_c_eval_string("(lambda (n) (set! note-total (+ note-total n)))"));
+
+  std::string path =
+      "/tmp/guile-mpack-rpc-test-" + std::to_string(::getpid()) + ".sock";
+  guile_rpc::listenUnix(st, path);
+
+  client_result result;
+  std::thread client(runClient, path, std::ref(st), std::ref(result));
+  guile_rpc::run(st);
+  client.join();
+  ::unlink(path.c_str());
+
+  if (scm_to_int(scm_c_eval_string("note-total")) != 7) {
+    result.failures.push_back("notification not delivered");
+  }
+
+  for (const auto &f : result.failures) {
+    std::printf("FAIL %s\n", f.c_str());
+  }
+  std::printf("%zu responses, %zu failures\n", result.responses,
+              result.failures.size());
+  scm_remember_upto_here_1(server);
+  return result.failures.empty() ? 0 : 1;
+}
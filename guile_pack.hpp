@@ -1,9 +1,20 @@
 #pragma once
 
+#include "guile_ext.hpp"
+#include "guile_lz.hpp"
 #include "guile_object.hpp"
+#include "guile_record.hpp"
 #include "guile_shared.hpp"
+#include "guile_stats.hpp"
+#include <algorithm>
+#include <cmath>
 #include <cstdlib>
+#include <cstring>
+#include <limits>
 #include <stdexcept>
+#include <string_view>
+#include <type_traits>
+#include <vector>
 
 #include <msgpack.hpp>
 
@@ -20,6 +31,14 @@ using flags_type = uint64_t;
 enum class pack_flags : uint64_t {
   disable_symbol_extension = 1 << 0,
   disable_keyword_extension = 1 << 1,
+  records_positional = 1 << 2,
+  share_structure = 1 << 3,
+  canonical = 1 << 4,
+  // Proper lists whose elements are all pairs are packed as maps.
+  alist_as_map = 1 << 5,
+  // (type . bytevector) pairs with a type in int8 range, which is how exts
+  // with no unpacker decode, are packed as that ext.
+  ext_pairs = 1 << 6,
 
   // exceptional circumstances
   override_unknowns = 1 << 8,
@@ -47,6 +66,341 @@ template <typename T>
 inline void packDispatch(SCM value, guile_object::guile_type guile_t,
                          msgpack::packer<T> &packer, flags_type flags);
 
+/// A strong copy of a weak table's entries as key, value, key, value...
+/// Taken so that the map header matches the entries written even if the
+/// collector clears some of them meanwhile.  The entries live in one GC
+/// allocation, which is scanned and kept alive through the pointer here.
+struct weak_snapshot {
+  SCM *entries = nullptr;
+  size_t size = 0;
+};
+
+namespace weak {
+
+struct fill_state {
+  SCM *entries;
+  size_t capacity;
+  size_t size;
+};
+
+inline SCM countEntry(void *closure, SCM, SCM, SCM result) {
+  ++*static_cast<size_t *>(closure);
+  return result;
+}
+
+inline SCM fillEntry(void *closure, SCM key, SCM value, SCM result) {
+  auto *st = static_cast<fill_state *>(closure);
+  // Entries added since the count are left out.
+  if (st->size < st->capacity) {
+    st->entries[2 * st->size] = key;
+    st->entries[2 * st->size + 1] = value;
+    st->size++;
+  }
+  return result;
+}
+
+} // namespace weak
+
+inline weak_snapshot snapshotWeakTable(SCM table) {
+  size_t n = 0;
+  scm_internal_hash_fold(weak::countEntry, &n, SCM_BOOL_F, table);
+  if (n == 0) {
+    return {};
+  }
+  weak::fill_state st{static_cast<SCM *>(scm_gc_malloc(
+                          2 * n * sizeof(SCM), "msgpack weak table snapshot")),
+                      n, 0};
+  scm_internal_hash_fold(weak::fillEntry, &st, SCM_BOOL_F, table);
+  return {st.entries, st.size};
+}
+
+// Ext bodies that are msgpack themselves, those of records and shared
+// definitions, are packed into one growable buffer per thread.  A body
+// nested inside another is packed in place right after its parent's bytes,
+// behind room for the header, which is filled in once its length is known;
+// only the outermost body is copied out to the real stream.  Bytes already
+// written stay put, so each body is written once however deeply exts nest.
+namespace ext_body {
+
+class buffer {
+public:
+  void write(const char *data, size_t len) {
+    bytes_.insert(bytes_.end(), data, data + len);
+  }
+
+  size_t size() const noexcept { return bytes_.size(); }
+  char *data() noexcept { return bytes_.data(); }
+
+  /// Make room for `by` more bytes at `pos`, or close up -`by` bytes there.
+  void shift(size_t pos, ptrdiff_t by) {
+    size_t old_size = bytes_.size();
+    if (by > 0) {
+      bytes_.resize(old_size + by);
+    }
+    std::memmove(bytes_.data() + pos + by, bytes_.data() + pos,
+                 old_size - pos);
+    if (by < 0) {
+      bytes_.resize(old_size + by);
+    }
+  }
+
+  /// Drop everything from pos on.  An emptied buffer that grew past
+  /// `max_retained` gives its memory back.
+  void truncate(size_t pos) {
+    bytes_.resize(pos);
+    if (pos == 0 && bytes_.capacity() > max_retained) {
+      std::vector<char>().swap(bytes_);
+    }
+  }
+
+private:
+  static constexpr size_t max_retained = size_t{1} << 20;
+  std::vector<char> bytes_;
+};
+
+inline buffer &local() {
+  thread_local buffer b;
+  return b;
+}
+
+/// Receives an ext header or an integer from msgpack-c, at most 6 bytes.
+struct header_bytes {
+  char data[6];
+  size_t size = 0;
+
+  void write(const char *p, size_t len) {
+    std::memcpy(data + size, p, len);
+    size += len;
+  }
+};
+
+// The header reserved for a nested body before its length is known: the 3
+// bytes of an ext8, the most common size.
+constexpr size_t reserved_header = 3;
+
+/// Pack an ext of type ext_id whose body pack_body(body_packer) writes.
+/// pack_body takes a msgpack::packer<buffer>&.
+template <typename T, typename PackBody>
+inline void pack(msgpack::packer<T> &packer, int8_t ext_id,
+                 PackBody &&pack_body) {
+  buffer &buf = local();
+  if constexpr (std::is_same_v<T, buffer>) {
+    // Already inside a body in buf: pack this one in place.
+    size_t start = buf.size();
+    const char reserved[reserved_header] = {};
+    buf.write(reserved, reserved_header);
+    pack_body(packer);
+
+    size_t len = buf.size() - start - reserved_header;
+    header_bytes h;
+    msgpack::packer<header_bytes>(h).pack_ext(len, ext_id);
+    if (h.size != reserved_header) {
+      buf.shift(start + reserved_header,
+                static_cast<ptrdiff_t>(h.size) -
+                    static_cast<ptrdiff_t>(reserved_header));
+    }
+    std::memcpy(buf.data() + start, h.data, h.size);
+  } else {
+    // Appended after anything in progress, in case this packer is itself
+    // writing for a body (canonical map keys are packed aside).
+    size_t start = buf.size();
+    msgpack::packer<buffer> body_packer(buf);
+    pack_body(body_packer);
+    size_t len = buf.size() - start;
+    packer.pack_ext(len, ext_id);
+    packer.pack_ext_body(buf.data() + start, len);
+    buf.truncate(start);
+  }
+}
+
+} // namespace ext_body
+
+// Shared structure support.  Before packing a document with
+// share_structure, a pre-pass counts how often each heap object is reached.
+// Objects reached more than once are written once, wrapped in a definition
+// ext, and every later occurrence becomes a reference ext holding only the
+// definition's index.  Cyclic structures terminate because the second visit
+// of an object is always a reference.
+namespace share {
+
+struct state {
+  // Number of times each shareable object is reachable, from the pre-pass.
+  SCM counts;
+  // Index assigned to each object already written as a definition.
+  SCM ids;
+  uint32_t next_id = 0;
+  // The object whose definition body is being packed, which must not become
+  // a reference to itself.
+  SCM defining = SCM_BOOL_F;
+};
+
+inline thread_local state *current = nullptr;
+
+/// Installs a fresh state for one document on the calling thread.  Lives on
+/// the C stack, where the collector sees the tables it holds.
+class scope {
+public:
+  scope() : prev_(current) {
+    state_.counts = scm_c_make_hash_table(64);
+    state_.ids = scm_c_make_hash_table(64);
+    current = &state_;
+  }
+  scope(const scope &) = delete;
+  scope &operator=(const scope &) = delete;
+  ~scope() { current = prev_; }
+
+  state &get() noexcept { return state_; }
+
+private:
+  state state_;
+  state *prev_;
+};
+
+inline bool isShareable(guile_type gt) noexcept {
+  return gt == guile_type::pair || gt == guile_type::vector ||
+         gt == guile_type::hashtable || gt == guile_type::weak_table ||
+         gt == guile_type::string || gt == guile_type::struct_scm;
+}
+
+/// Number of pairs in the spine of a list, counting each pair of a circular
+/// spine once.
+inline size_t spineLength(SCM list) {
+  SCM slow = list, fast = list;
+  size_t n = 0;
+  while (SCM_CONSP(fast)) {
+    fast = SCM_CDR(fast);
+    n++;
+    if (!SCM_CONSP(fast)) {
+      break;
+    }
+    fast = SCM_CDR(fast);
+    n++;
+    slow = SCM_CDR(slow);
+    if (scm_is_eq(fast, slow)) {
+      // Floyd: walk from the head to the first pair of the cycle, then once
+      // around it.
+      size_t tail = 0;
+      for (slow = list; !scm_is_eq(slow, fast);
+           slow = SCM_CDR(slow), fast = SCM_CDR(fast)) {
+        tail++;
+      }
+      size_t cycle = 1;
+      for (fast = SCM_CDR(slow); !scm_is_eq(fast, slow); fast = SCM_CDR(fast)) {
+        cycle++;
+      }
+      return tail + cycle;
+    }
+  }
+  return n;
+}
+
+/// The pre-pass.  Follows the same edges the packers do and stops at the
+/// second visit of any object.
+inline void countShared(SCM value, SCM counts) {
+  guile_type gt = guile_object::guile_type_of(value);
+  if (!isShareable(gt)) {
+    return;
+  }
+  size_t seen = scm_to_size_t(scm_hashq_ref(counts, value, SCM_INUM0));
+  scm_hashq_set_x(counts, value, scm_from_size_t(seen + 1));
+  if (seen != 0) {
+    return;
+  }
+
+  switch (gt) {
+  case guile_type::pair: {
+    SCM current = value;
+    for (size_t n = spineLength(value); n > 0; n--) {
+      countShared(SCM_CAR(current), counts);
+      current = SCM_CDR(current);
+    }
+    break;
+  }
+  case guile_type::vector:
+    for (size_t i = 0; i < SCM_SIMPLE_VECTOR_LENGTH(value); i++) {
+      countShared(SCM_SIMPLE_VECTOR_REF(value, i), counts);
+    }
+    break;
+  case guile_type::hashtable: {
+    SCM buckets = SCM_HASHTABLE_VECTOR(value);
+    for (size_t i = 0; i < SCM_SIMPLE_VECTOR_LENGTH(buckets); i++) {
+      for (SCM b = SCM_SIMPLE_VECTOR_REF(buckets, i); SCM_CONSP(b);
+           b = SCM_CDR(b)) {
+        if (SCM_CONSP(SCM_CAR(b))) {
+          countShared(SCM_CAAR(b), counts);
+          countShared(SCM_CDAR(b), counts);
+        }
+      }
+    }
+    break;
+  }
+  case guile_type::weak_table: {
+    weak_snapshot snap = snapshotWeakTable(value);
+    for (size_t i = 0; i < 2 * snap.size; i++) {
+      countShared(snap.entries[i], counts);
+    }
+    break;
+  }
+  case guile_type::struct_scm: {
+    const guile_record::record_layout &layout = guile_record::layoutOf(value);
+    if (!layout.is_record ||
+        layout.ext_packer.load(std::memory_order_acquire) != nullptr) {
+      break;
+    }
+    if (layout.table_field >= 0) {
+      countShared(SCM_STRUCT_SLOT_REF(value, layout.slots[layout.table_field]),
+                  counts);
+      break;
+    }
+    for (size_t slot : layout.slots) {
+      countShared(SCM_STRUCT_SLOT_REF(value, slot), counts);
+    }
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+/// Write value as a definition or a reference if it is shared.  Returns
+/// false when it should be packed normally.
+template <typename T>
+inline bool packShared(SCM value, guile_type gt, msgpack::packer<T> &packer,
+                       flags_type flags) {
+  state &st = *current;
+  if (scm_is_eq(value, st.defining)) {
+    st.defining = SCM_BOOL_F;
+    return false;
+  }
+
+  SCM id = scm_hashq_ref(st.ids, value, SCM_BOOL_F);
+  if (scm_is_true(id)) {
+    // A reference body is just the index, at most 5 bytes.
+    ext_body::header_bytes body;
+    msgpack::packer<ext_body::header_bytes>(body).pack_uint32(
+        scm_to_uint32(id));
+    packer.pack_ext(body.size, guile_shared::shared_ref_ext_id);
+    packer.pack_ext_body(body.data, body.size);
+    return true;
+  }
+
+  if (scm_to_size_t(scm_hashq_ref(st.counts, value, SCM_INUM0)) < 2) {
+    return false;
+  }
+
+  uint32_t index = st.next_id++;
+  scm_hashq_set_x(st.ids, value, scm_from_uint32(index));
+  st.defining = value;
+  ext_body::pack(packer, guile_shared::shared_def_ext_id,
+                 [&](auto &body_packer) {
+                   body_packer.pack_uint32(index);
+                   packDispatch(value, gt, body_packer, flags);
+                 });
+  return true;
+}
+
+} // namespace share
+
 template <guile_type GT> struct GuilePacker : std::false_type {
 
   template <typename T>
@@ -56,6 +410,7 @@ template <guile_type GT> struct GuilePacker : std::false_type {
       throw pack_error("cannot pack unknown value");
       return;
     } else {
+      guile_stats::countFallback();
       if ((flags & pack_flags::unknown_is_nil) != 0) {
         packer.pack_nil();
       } else if ((flags & pack_flags::unknown_is_panic) != 0) {
@@ -96,9 +451,45 @@ GUILE_PACKER_TRIVIAL(guile_type::eol, pack_nil());
 
 GUILE_PACKER_TRIVIAL(guile_type::nil, pack_nil());
 
-GUILE_PACKER_SIMPLE(guile_type::fixed_num, scm_to_int64, pack_fix_int64);
+template <> struct GuilePacker<guile_type::fixed_num> : std::true_type {
+  template <typename T>
+  static inline void pack(SCM value, msgpack::packer<T> &packer,
+                          flags_type flags) {
+    if ((flags & pack_flags::canonical) != 0) {
+      packer.pack_int64(scm_to_int64(value));
+    } else {
+      packer.pack_fix_int64(scm_to_int64(value));
+    }
+  }
+};
 
-GUILE_PACKER_SIMPLE(guile_type::real, scm_to_double, pack_double);
+namespace canonical {
+
+/// The canonical float policy.  Floats are always written as float64, so a
+/// float32 widens, exactly.  Every NaN payload and sign collapses to the one
+/// quiet NaN, and -0.0 becomes 0.0, so that numbers that compare equal
+/// encode alike.
+inline double canonicalDouble(double d) noexcept {
+  if (std::isnan(d)) {
+    return std::numeric_limits<double>::quiet_NaN();
+  }
+  // True for -0.0 as well.
+  return d == 0.0 ? 0.0 : d;
+}
+
+} // namespace canonical
+
+template <> struct GuilePacker<guile_type::real> : std::true_type {
+  template <typename T>
+  static inline void pack(SCM value, msgpack::packer<T> &packer,
+                          flags_type flags) {
+    double d = scm_to_double(value);
+    if ((flags & pack_flags::canonical) != 0) {
+      d = canonical::canonicalDouble(d);
+    }
+    packer.pack_double(d);
+  }
+};
 
 template <> struct GuilePacker<guile_type::boolean> : std::true_type {
   template <typename T>
@@ -111,10 +502,118 @@ template <> struct GuilePacker<guile_type::boolean> : std::true_type {
   }
 };
 
+namespace canonical {
+
+struct encoded_entry {
+  size_t offset;
+  size_t size;
+  SCM value;
+  // Encoded value, only filled in for entries whose keys encode alike.
+  size_t value_offset = 0;
+  size_t value_size = 0;
+};
+
+/// Canonical map order: every key is packed once into a scratch buffer, the
+/// entries are sorted on those bytes, and the key bytes are copied out
+/// verbatim ahead of each value.  Keys are packed without structure sharing
+/// so that their bytes do not depend on what was packed before.  Distinct
+/// keys can still encode alike, e.g. equal? strings in a hashq table; such
+/// entries are ordered by their encoded values, so the output never depends
+/// on bucket order.  `visit(fn)` calls fn(key, value) for each entry.
+template <typename T, typename Visit>
+inline void packSortedMap(size_t len, Visit &&visit,
+                          msgpack::packer<T> &packer, flags_type flags) {
+  guile_shared::unwind_scope scope;
+  msgpack::sbuffer keys;
+  scope.destroy(keys);
+  msgpack::packer<msgpack::sbuffer> key_packer(keys);
+  flags_type key_flags =
+      flags & ~static_cast<flags_type>(pack_flags::share_structure);
+
+  std::vector<encoded_entry> entries;
+  scope.destroy(entries);
+  entries.reserve(len);
+  visit([&](SCM key, SCM value) {
+    size_t offset = keys.size();
+    ::guile_pack::packDispatch(key, guile_object::guile_type_of(key),
+                               key_packer, key_flags);
+    entries.push_back({offset, keys.size() - offset, value});
+  });
+
+  auto keyOf = [&keys](const encoded_entry &e) {
+    return std::string_view(keys.data() + e.offset, e.size);
+  };
+  std::sort(entries.begin(), entries.end(),
+            [&](const encoded_entry &a, const encoded_entry &b) {
+              return keyOf(a) < keyOf(b);
+            });
+
+  for (auto run = entries.begin(); run != entries.end();) {
+    auto end = std::find_if(run + 1, entries.end(), [&](const auto &e) {
+      return keyOf(e) != keyOf(*run);
+    });
+    if (end - run > 1) {
+      for (auto it = run; it != end; ++it) {
+        it->value_offset = keys.size();
+        ::guile_pack::packDispatch(it->value,
+                                   guile_object::guile_type_of(it->value),
+                                   key_packer, key_flags);
+        it->value_size = keys.size() - it->value_offset;
+      }
+      std::stable_sort(run, end,
+                       [&keys](const encoded_entry &a, const encoded_entry &b) {
+                         return std::string_view(keys.data() + a.value_offset,
+                                                 a.value_size) <
+                                std::string_view(keys.data() + b.value_offset,
+                                                 b.value_size);
+                       });
+    }
+    run = end;
+  }
+
+  packer.pack_map(entries.size());
+  for (const auto &e : entries) {
+    // pack_bin_body appends its bytes to the stream unchanged.
+    packer.pack_bin_body(keys.data() + e.offset, e.size);
+    ::guile_pack::packDispatch(e.value, guile_object::guile_type_of(e.value),
+                               packer, flags);
+  }
+}
+
+} // namespace canonical
+
 template <> struct GuilePacker<guile_type::pair> : std::true_type {
   template <typename T>
   static inline void pack(SCM value, msgpack::packer<T> &packer,
                           flags_type flags) {
+    if ((flags & pack_flags::ext_pairs) != 0 && isExt(value)) {
+      SCM body = SCM_CDR(value);
+      size_t len = SCM_BYTEVECTOR_LENGTH(body);
+      packer.pack_ext(len, static_cast<int8_t>(SCM_I_INUM(SCM_CAR(value))));
+      packer.pack_ext_body((const char *)SCM_BYTEVECTOR_CONTENTS(body), len);
+      return;
+    }
+
+    if ((flags & pack_flags::alist_as_map) != 0) {
+      long len = scm_ilength(value);
+      if (len > 0 && isAlist(value)) {
+        packAlist(value, static_cast<size_t>(len), packer, flags);
+        return;
+      }
+    }
+
+    if ((flags & pack_flags::share_structure) != 0) {
+      // A circular spine is cut where it first comes back to itself.
+      size_t n = share::spineLength(value);
+      packer.pack_array(n);
+      for (SCM current = value; n > 0; n--, current = SCM_CDR(current)) {
+        SCM head = SCM_CAR(current);
+        ::guile_pack::packDispatch<T>(head, guile_object::guile_type_of(head),
+                                      packer, flags);
+      }
+      return;
+    }
+
     std::deque<guile_object::SCMLazyTyped> typs{};
     SCM current = value, head, tail;
     while (SCM_CONSP(current)) {
@@ -130,6 +629,48 @@ template <> struct GuilePacker<guile_type::pair> : std::true_type {
       ::guile_pack::packDispatch<T>(t.value(), t.type(), packer, flags);
     }
   }
+
+private:
+  static inline bool isExt(SCM value) {
+    SCM type = SCM_CAR(value);
+    return scm_is_bytevector(SCM_CDR(value)) && SCM_I_INUMP(type) &&
+           SCM_I_INUM(type) >= INT8_MIN && SCM_I_INUM(type) <= INT8_MAX;
+  }
+
+  // value is a proper list.
+  static inline bool isAlist(SCM value) {
+    for (SCM current = value; SCM_CONSP(current); current = SCM_CDR(current)) {
+      if (!SCM_CONSP(SCM_CAR(current))) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /// Every entry is written, so a key that appears twice does too; a decoder
+  /// keeping the last value disagrees with assoc, which finds the first.
+  template <typename T>
+  static inline void packAlist(SCM value, size_t len,
+                               msgpack::packer<T> &packer, flags_type flags) {
+    auto visit = [value](auto &&fn) {
+      for (SCM current = value; SCM_CONSP(current);
+           current = SCM_CDR(current)) {
+        fn(SCM_CAAR(current), SCM_CDAR(current));
+      }
+    };
+
+    if ((flags & pack_flags::canonical) != 0) {
+      canonical::packSortedMap(len, visit, packer, flags);
+      return;
+    }
+    packer.pack_map(len);
+    visit([&](SCM key, SCM entry) {
+      ::guile_pack::packDispatch(key, guile_object::guile_type_of(key), packer,
+                                 flags);
+      ::guile_pack::packDispatch(entry, guile_object::guile_type_of(entry),
+                                 packer, flags);
+    });
+  }
 };
 
 template <> struct GuilePacker<guile_type::hashtable> : std::true_type {
@@ -139,6 +680,11 @@ template <> struct GuilePacker<guile_type::hashtable> : std::true_type {
                           flags_type flags) {
     size_t len = SCM_HASHTABLE_N_ITEMS(value);
 
+    if ((flags & pack_flags::canonical) != 0) {
+      packSorted(value, len, packer, flags);
+      return;
+    }
+
     packer.pack_map(len);
 
     SCM ref = SCM_HASHTABLE_VECTOR(value);
@@ -156,6 +702,23 @@ template <> struct GuilePacker<guile_type::hashtable> : std::true_type {
   }
 
 private:
+  template <typename T>
+  static inline void packSorted(SCM value, size_t len,
+                                msgpack::packer<T> &packer, flags_type flags) {
+    SCM buckets = SCM_HASHTABLE_VECTOR(value);
+    auto visit = [buckets](auto &&fn) {
+      for (size_t i = 0; i < SCM_SIMPLE_VECTOR_LENGTH(buckets); i++) {
+        for (SCM b = SCM_SIMPLE_VECTOR_REF(buckets, i); SCM_CONSP(b);
+             b = SCM_CDR(b)) {
+          if (SCM_CONSP(SCM_CAR(b))) {
+            fn(SCM_CAAR(b), SCM_CDAR(b));
+          }
+        }
+      }
+    };
+    canonical::packSortedMap(len, visit, packer, flags);
+  }
+
   template <typename T>
   static inline void packHTBucket(SCM value, msgpack::packer<T> &packer,
                                   flags_type flags) {
@@ -179,6 +742,57 @@ private:
   }
 };
 
+/// Weak tables are packed from a snapshot of their entries; see
+/// weak_snapshot.
+template <> struct GuilePacker<guile_type::weak_table> : std::true_type {
+  template <typename T>
+  static inline void pack(SCM value, msgpack::packer<T> &packer,
+                          flags_type flags) {
+    weak_snapshot snap = snapshotWeakTable(value);
+    if ((flags & pack_flags::canonical) != 0) {
+      auto visit = [&snap](auto &&fn) {
+        for (size_t i = 0; i < snap.size; i++) {
+          fn(snap.entries[2 * i], snap.entries[2 * i + 1]);
+        }
+      };
+      canonical::packSortedMap(snap.size, visit, packer, flags);
+      return;
+    }
+
+    packer.pack_map(snap.size);
+    for (size_t i = 0; i < 2 * snap.size; i++) {
+      SCM v = snap.entries[i];
+      ::guile_pack::packDispatch(v, guile_object::guile_type_of(v), packer,
+                                 flags);
+    }
+    scm_remember_upto_here_1(value);
+  }
+};
+
+template <> struct GuilePacker<guile_type::vector> : std::true_type {
+  template <typename T>
+  static inline void pack(SCM value, msgpack::packer<T> &packer,
+                          flags_type flags) {
+    size_t len = SCM_SIMPLE_VECTOR_LENGTH(value);
+    packer.pack_array(len);
+    for (size_t i = 0; i < len; i++) {
+      SCM v = SCM_SIMPLE_VECTOR_REF(value, i);
+      ::guile_pack::packDispatch(v, guile_object::guile_type_of(v), packer,
+                                 flags);
+    }
+  }
+};
+
+template <> struct GuilePacker<guile_type::bytevector> : std::true_type {
+  template <typename T>
+  static inline void pack(SCM value, msgpack::packer<T> &packer,
+                          flags_type flags) {
+    size_t len = SCM_BYTEVECTOR_LENGTH(value);
+    packer.pack_bin(len);
+    packer.pack_bin_body((const char *)SCM_BYTEVECTOR_CONTENTS(value), len);
+  }
+};
+
 template <> struct GuilePacker<guile_type::string> {
 
   template <typename T>
@@ -232,6 +846,90 @@ template <> struct GuilePacker<guile_type::keyword> {
   }
 };
 
+/// Records are packed from their slots using a layout cached per vtable.
+/// An ext packer registered for the vtable takes precedence.  SRFI-69 and
+/// R6RS hashtables, which are records wrapping a native table, are packed
+/// as that table.  Types
+/// registered under a tag become that tag's ext with a body of [field...] in
+/// wire order.  Other records become a map of field name to value, or with
+/// records_positional a record ext whose body is the array
+/// [type-name, field...].  Structs that are not records (GOOPS instances,
+/// bare vtables) take the unknown type path.
+template <> struct GuilePacker<guile_type::struct_scm> : std::true_type {
+
+  template <typename T>
+  static inline void pack(SCM value, msgpack::packer<T> &packer,
+                          flags_type flags) {
+    const guile_record::record_layout &layout =
+        guile_record::layoutOf(value);
+    if (const auto *ext = layout.ext_packer.load(std::memory_order_acquire)) {
+      if (guile_ext::packWith(*ext, value, packer)) {
+        return;
+      }
+    }
+    if (!layout.is_record) {
+      GuilePacker<guile_type::invalid>::pack(value, packer, flags);
+      return;
+    }
+    if (layout.table_field >= 0) {
+      packSlot(value, layout.slots[layout.table_field], packer, flags);
+      return;
+    }
+
+    if (const auto *entry = layout.tagged.load(std::memory_order_acquire)) {
+      ext_body::pack(packer, guile_record::record_tag_ext_id(entry->tag),
+                     [&](auto &body_packer) {
+                       body_packer.pack_array(entry->wire_slots.size());
+                       for (size_t slot : entry->wire_slots) {
+                         packSlot(value, slot, body_packer, flags);
+                       }
+                     });
+      return;
+    }
+
+    if ((flags & pack_flags::records_positional) == 0) {
+      packer.pack_map(layout.slots.size());
+      for (size_t i = 0; i < layout.slots.size(); i++) {
+        packName(layout.field_names[i], packer, flags);
+        packSlot(value, layout.slots[i], packer, flags);
+      }
+      return;
+    }
+
+    ext_body::pack(packer, guile_shared::record_ext_id,
+                   [&](auto &body_packer) {
+                     body_packer.pack_array(layout.slots.size() + 1);
+                     packName(layout.type_name, body_packer, flags);
+                     for (size_t slot : layout.slots) {
+                       packSlot(value, slot, body_packer, flags);
+                     }
+                   });
+  }
+
+private:
+  // Field and type names are symbols on the Scheme side and are packed the
+  // same way GuilePacker<symbol> would pack them.
+  template <typename T>
+  static inline void packName(const std::string &name,
+                              msgpack::packer<T> &packer, flags_type flags) {
+    if ((flags & pack_flags::disable_symbol_extension) == 0) {
+      packer.pack_ext(name.size(), guile_shared::symbol_ext_id);
+      packer.pack_ext_body(name.data(), name.size());
+    } else {
+      packer.pack_str(name.size());
+      packer.pack_str_body(name.data(), name.size());
+    }
+  }
+
+  template <typename T>
+  static inline void packSlot(SCM value, size_t slot,
+                              msgpack::packer<T> &packer, flags_type flags) {
+    SCM field = SCM_STRUCT_SLOT_REF(value, slot);
+    ::guile_pack::packDispatch(field, guile_object::guile_type_of(field),
+                               packer, flags);
+  }
+};
+
 // TODO: Implement packer for array using scm_array_get_handle
 // TODO: Handle homogenous arrays with inline functions in
 // libguile/array_handle.h
@@ -239,6 +937,18 @@ template <> struct GuilePacker<guile_type::keyword> {
 template <typename T>
 inline void packDispatch(SCM value, guile_object::guile_type guile_t,
                          msgpack::packer<T> &packer, flags_type flags) {
+  guile_stats::countPack(guile_t);
+  if ((flags & pack_flags::share_structure) != 0 && share::current &&
+      share::isShareable(guile_t) &&
+      share::packShared(value, guile_t, packer, flags)) {
+    return;
+  }
+  if (const auto *ext = guile_ext::packerFor(guile_t)) {
+    if (guile_ext::packWith(*ext, value, packer)) {
+      return;
+    }
+  }
+
   switch (guile_t) {
 
   case guile_type::boolean:
@@ -347,4 +1057,78 @@ inline void packDispatch(SCM value, guile_object::guile_type guile_t,
     break;
   }
 }
+
+/// Pack one complete document.  With share_structure, objects reachable more
+/// than once are written once and referenced after that, which also makes
+/// cyclic structures packable.
+template <typename T>
+inline void packDocument(SCM value, msgpack::packer<T> &packer,
+                         flags_type flags) {
+  guile_stats::sampled_timer timer(guile_stats::timing::pack);
+  // A Scheme throw from inside the pack (a handler, a slot that does not
+  // convert) unwinds past the C++ destructors, so the thread's shared
+  // structure state and ext body buffer are put back by a dynwind handler.
+  struct unwind_state {
+    share::state *share;
+    size_t body_size;
+
+    static void unwind(void *data) {
+      auto *u = static_cast<unwind_state *>(data);
+      share::current = u->share;
+      ext_body::local().truncate(u->body_size);
+    }
+  } unwind{share::current, ext_body::local().size()};
+  scm_dynwind_begin(static_cast<scm_t_dynwind_flags>(0));
+  scm_dynwind_unwind_handler(unwind_state::unwind, &unwind,
+                             static_cast<scm_t_wind_flags>(0));
+
+  try {
+    if ((flags & pack_flags::share_structure) == 0) {
+      packDispatch(value, guile_object::guile_type_of(value), packer, flags);
+    } else {
+      share::scope scope;
+      share::countShared(value, scope.get().counts);
+      packDispatch(value, guile_object::guile_type_of(value), packer, flags);
+    }
+  } catch (...) {
+    // C++ exceptions leave through the destructors; the context still has
+    // to be closed.
+    scm_dynwind_end();
+    throw;
+  }
+  scm_dynwind_end();
+}
+
+/// Documents smaller than this are not worth compressing.
+constexpr size_t default_compress_threshold = 4096;
+
+/// Pack value as one document into out.  When the packed document is at
+/// least `threshold` bytes and compression shrinks it, it is written as a
+/// compressed ext frame instead, which the unpacker expands transparently.
+inline void packCompressed(SCM value, msgpack::sbuffer &out, flags_type flags,
+                           size_t threshold) {
+  guile_shared::unwind_scope scope;
+  msgpack::sbuffer doc;
+  scope.destroy(doc);
+  msgpack::packer<msgpack::sbuffer> doc_packer(doc);
+  packDocument(value, doc_packer, flags);
+
+  if (doc.size() >= threshold && doc.size() <= UINT32_MAX) {
+    std::vector<char> block(guile_lz::compressBound(doc.size()));
+    size_t n = guile_lz::compress(doc.data(), doc.size(), block.data());
+    if (n + 4 < doc.size()) {
+      uint32_t size = static_cast<uint32_t>(doc.size());
+      const char prefix[4] = {
+          static_cast<char>(size >> 24), static_cast<char>(size >> 16),
+          static_cast<char>(size >> 8), static_cast<char>(size)};
+      msgpack::packer<msgpack::sbuffer> packer(out);
+      packer.pack_ext(n + 4, guile_shared::compressed_ext_id);
+      packer.pack_ext_body(prefix, 4);
+      packer.pack_ext_body(block.data(), n);
+      return;
+    }
+  }
+  out.write(doc.data(), doc.size());
+}
+
 } // namespace guile_pack
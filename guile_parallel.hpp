@@ -0,0 +1,367 @@
+#pragma once
+
+#include "guile_object.hpp"
+#include "guile_pack.hpp"
+#include "guile_scan.hpp"
+#include "guile_unpack.hpp"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <msgpack.hpp>
+
+namespace guile_parallel {
+
+using parallel_error = std::runtime_error;
+
+/// A process wide pool of threads registered with Guile.  Workers enter Guile
+/// once, at thread start, and leave guile mode while idle so they never hold
+/// up a collection.
+class WorkerPool {
+public:
+  using job_type = std::function<void(size_t)>;
+
+  static WorkerPool &instance() {
+    static WorkerPool *pool = new WorkerPool();
+    return *pool;
+  }
+
+  static size_t defaultConcurrency() noexcept {
+    return std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  /// Call job(i) for i in [0, n) with i == 0 on the calling thread, which
+  /// must be in guile mode.  Returns once every call has finished.  Jobs
+  /// must not throw; see detail::guardedWork.  Workers are permanent, so n
+  /// is first capped at defaultConcurrency(); jobs claim their work from a
+  /// shared counter rather than by index.  A call made from inside a job
+  /// runs every index inline on its own thread, since the pool is already
+  /// busy with the outer run.
+  void run(size_t n, const job_type &job) {
+    n = std::min(n, defaultConcurrency());
+    if (n <= 1 || in_job_) {
+      for (size_t i = 0; i < std::max<size_t>(n, 1); i++) {
+        job(i);
+      }
+      return;
+    }
+
+    RunArgs args{this, n, &job};
+    scm_without_guile(&WorkerPool::lockAndStart, &args);
+
+    in_job_ = true;
+    job(0);
+    in_job_ = false;
+
+    scm_without_guile(&WorkerPool::waitAndUnlock, this);
+  }
+
+private:
+  struct RunArgs {
+    WorkerPool *pool;
+    size_t n;
+    const job_type *job;
+  };
+
+  WorkerPool() = default;
+
+  static void *lockAndStart(void *data) {
+    auto *args = static_cast<RunArgs *>(data);
+    WorkerPool *self = args->pool;
+
+    self->run_lock_.lock();
+
+    std::unique_lock lock(self->mutex_);
+    while (self->spawned_ < args->n - 1) {
+      size_t index = ++self->spawned_;
+      std::thread([self, index]() {
+        WorkerArgs wargs{self, index};
+        scm_with_guile(&WorkerPool::workerMain, &wargs);
+      }).detach();
+    }
+
+    self->job_ = args->job;
+    self->active_ = args->n - 1;
+    self->pending_ = args->n - 1;
+    self->generation_++;
+    self->wake_.notify_all();
+    return nullptr;
+  }
+
+  static void *waitAndUnlock(void *data) {
+    auto *self = static_cast<WorkerPool *>(data);
+    {
+      std::unique_lock lock(self->mutex_);
+      self->done_.wait(lock, [self]() { return self->pending_ == 0; });
+      self->job_ = nullptr;
+    }
+    self->run_lock_.unlock();
+    return nullptr;
+  }
+
+  struct WorkerArgs {
+    WorkerPool *pool;
+    size_t index;
+  };
+
+  struct WaitArgs {
+    WorkerPool *pool;
+    size_t index;
+    uint64_t seen;
+    const job_type *job;
+  };
+
+  static void *waitForJob(void *data) {
+    auto *args = static_cast<WaitArgs *>(data);
+    WorkerPool *self = args->pool;
+    std::unique_lock lock(self->mutex_);
+    self->wake_.wait(lock, [&]() {
+      return self->generation_ != args->seen && args->index <= self->active_;
+    });
+    args->seen = self->generation_;
+    args->job = self->job_;
+    return nullptr;
+  }
+
+  static void *workerMain(void *data) {
+    auto *wargs = static_cast<WorkerArgs *>(data);
+    WaitArgs args{wargs->pool, wargs->index, 0, nullptr};
+    WorkerPool *self = wargs->pool;
+
+    while (true) {
+      scm_without_guile(&WorkerPool::waitForJob, &args);
+      in_job_ = true;
+      (*args.job)(args.index);
+      in_job_ = false;
+
+      std::unique_lock lock(self->mutex_);
+      if (--self->pending_ == 0) {
+        self->done_.notify_all();
+      }
+    }
+    return nullptr;
+  }
+
+  // Set while this thread is running a job.
+  static inline thread_local bool in_job_ = false;
+
+  std::mutex run_lock_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::condition_variable done_;
+  size_t spawned_ = 0;
+  const job_type *job_ = nullptr;
+  size_t active_ = 0;
+  size_t pending_ = 0;
+  uint64_t generation_ = 0;
+};
+
+namespace detail {
+
+// Records the first failure raised by any worker, C++ or Scheme.
+struct FailureSlot {
+  std::atomic<bool> failed{false};
+  std::mutex mutex;
+  std::string message;
+
+  void set(std::string msg) {
+    std::lock_guard lock(mutex);
+    if (!failed.exchange(true)) {
+      message = std::move(msg);
+    }
+  }
+};
+
+struct CatchArgs {
+  const std::function<void()> *body;
+  FailureSlot *failure;
+};
+
+inline SCM catchBody(void *data) {
+  auto *args = static_cast<CatchArgs *>(data);
+  try {
+    (*args->body)();
+  } catch (const std::exception &e) {
+    args->failure->set(e.what());
+  }
+  return SCM_UNSPECIFIED;
+}
+
+inline SCM catchHandler(void *data, SCM key, SCM rest) {
+  auto *args = static_cast<CatchArgs *>(data);
+  char *text = scm_to_utf8_string(
+      scm_object_to_string(scm_cons(key, rest), SCM_UNDEFINED));
+  args->failure->set(std::string("scheme error in worker: ") + text);
+  ::free(text);
+  return SCM_UNSPECIFIED;
+}
+
+/// Run body on a worker, recording rather than propagating any error.
+inline void guardedWork(const std::function<void()> &body,
+                        FailureSlot &failure) {
+  CatchArgs args{&body, &failure};
+  scm_internal_catch(SCM_BOOL_T, catchBody, &args, catchHandler, &args);
+}
+
+/// True when data holds shared structure exts anywhere, including inside
+/// the bodies of records and definitions, which may hold them too.
+inline bool hasSharedStructure(const char *data, size_t len) {
+  auto bit = [](int8_t ext_id) { return static_cast<uint8_t>(ext_id); };
+  guile_scan::ext_set nested, seen;
+  nested.set(bit(guile_shared::record_ext_id));
+  nested.set(bit(guile_shared::shared_def_ext_id));
+  for (size_t i = 0; i < guile_shared::record_tag_count; i++) {
+    nested.set(bit(guile_shared::record_tag_ext_id_first + i));
+  }
+  guile_scan::collectExtTypes(data, len, 0, nested, seen);
+  return seen.test(bit(guile_shared::shared_def_ext_id)) ||
+         seen.test(bit(guile_shared::shared_ref_ext_id));
+}
+
+} // namespace detail
+
+/// Number of vector elements a worker claims at a time.  Small enough to
+/// balance uneven records, large enough to keep the shared counter cold.
+constexpr size_t pack_block_size = 64;
+
+/// Pack each element of a simple vector on up to `threads` Guile threads.
+/// Returns a vector of bytevectors, or when `concatenate` is set a single
+/// bytevector holding the documents in their original order.
+inline SCM packParallel(SCM values, size_t threads, bool concatenate,
+                        guile_pack::flags_type flags) {
+  size_t count = SCM_SIMPLE_VECTOR_LENGTH(values);
+  size_t blocks = (count + pack_block_size - 1) / pack_block_size;
+  threads = std::max<size_t>(1, std::min(threads, blocks));
+
+  SCM result = concatenate ? SCM_BOOL_F : scm_c_make_vector(count, SCM_BOOL_F);
+  std::vector<msgpack::sbuffer> block_bufs(concatenate ? blocks : 0);
+  std::atomic<size_t> next_block{0};
+  detail::FailureSlot failure;
+
+  auto packBlocks = [&]() {
+    guile_shared::unwind_scope scope;
+    msgpack::sbuffer scratch;
+    scope.destroy(scratch);
+    size_t block;
+    while (!failure.failed.load(std::memory_order_relaxed) &&
+           (block = next_block.fetch_add(1, std::memory_order_relaxed)) <
+               blocks) {
+      size_t first = block * pack_block_size;
+      size_t last = std::min(count, first + pack_block_size);
+      msgpack::sbuffer &buf = concatenate ? block_bufs[block] : scratch;
+      msgpack::packer<msgpack::sbuffer> packer(buf);
+
+      for (size_t i = first; i < last; i++) {
+        SCM value = SCM_SIMPLE_VECTOR_REF(values, i);
+        guile_pack::packDocument(value, packer, flags);
+        if (!concatenate) {
+          SCM bv = scm_c_make_bytevector(buf.size());
+          memcpy(SCM_BYTEVECTOR_CONTENTS(bv), buf.data(), buf.size());
+          SCM_SIMPLE_VECTOR_SET(result, i, bv);
+          guile_stats::countPackedBytes(buf.size());
+          buf.clear();
+        }
+      }
+    }
+  };
+  std::function<void()> body = packBlocks;
+
+  WorkerPool::instance().run(
+      threads, [&](size_t) { detail::guardedWork(body, failure); });
+
+  if (failure.failed) {
+    throw parallel_error(failure.message);
+  }
+
+  if (concatenate) {
+    size_t total = 0;
+    for (auto &buf : block_bufs) {
+      total += buf.size();
+    }
+    guile_stats::countPackedBytes(total);
+    result = scm_c_make_bytevector(total);
+    char *out = (char *)SCM_BYTEVECTOR_CONTENTS(result);
+    for (auto &buf : block_bufs) {
+      memcpy(out, buf.data(), buf.size());
+      out += buf.size();
+    }
+  }
+
+  return result;
+}
+
+/// Number of array elements a worker claims at a time when decoding.
+constexpr size_t unpack_block_size = 64;
+
+/// Arrays shorter than this are decoded on the calling thread; the scan and
+/// hand-off cost more than they save.
+constexpr size_t unpack_parallel_threshold = 4 * unpack_block_size;
+
+/// Decode data, converting the elements of a top-level array on up to
+/// `threads` Guile threads.  A structural scan first finds the element
+/// boundaries, then each worker decodes whole blocks of elements with its own
+/// zone and stores them straight into the result vector.  Anything other than
+/// a large top-level array is decoded on the calling thread.  data must stay
+/// valid and unmoved for the duration of the call.  Each element is decoded
+/// as a document of its own, so an array packed with share_structure, whose
+/// references may point into other elements, is decoded serially too.
+inline SCM unpackParallel(const char *data, size_t len, size_t threads,
+                          guile_unpack::flags_t flags) {
+  using guile_shared::detail::referenceAll;
+
+  guile_scan::validate(data, len, 0, guile_scan::currentLimits());
+  std::vector<size_t> offsets;
+  if (!guile_scan::arrayElementOffsets(data, len, 0, offsets) ||
+      offsets.size() - 1 < unpack_parallel_threshold || threads <= 1 ||
+      detail::hasSharedStructure(data, len)) {
+    msgpack::object_handle handle;
+    msgpack::unpack(handle, data, len, referenceAll);
+    return guile_unpack::unpackDocument(handle.get(), flags);
+  }
+
+  size_t count = offsets.size() - 1;
+  size_t blocks = (count + unpack_block_size - 1) / unpack_block_size;
+  threads = std::min(threads, blocks);
+
+  SCM result = scm_c_make_vector(count, SCM_BOOL_F);
+  std::atomic<size_t> next_block{0};
+  detail::FailureSlot failure;
+
+  std::function<void()> body = [&]() {
+    guile_shared::unwind_scope scope;
+    msgpack::zone zone;
+    scope.destroy(zone);
+    size_t block;
+    while (!failure.failed.load(std::memory_order_relaxed) &&
+           (block = next_block.fetch_add(1, std::memory_order_relaxed)) <
+               blocks) {
+      size_t first = block * unpack_block_size;
+      size_t last = std::min(count, first + unpack_block_size);
+
+      for (size_t i = first; i < last; i++) {
+        size_t off = offsets[i];
+        msgpack::object obj =
+            msgpack::unpack(zone, data, offsets[i + 1], off, referenceAll);
+        SCM_SIMPLE_VECTOR_SET(result, i,
+                              guile_unpack::unpackDocument(obj, flags));
+      }
+      zone.clear();
+    }
+  };
+
+  WorkerPool::instance().run(
+      threads, [&](size_t) { detail::guardedWork(body, failure); });
+
+  if (failure.failed) {
+    throw parallel_error(failure.message);
+  }
+  return result;
+}
+
+} // namespace guile_parallel
@@ -0,0 +1,281 @@
+#pragma once
+
+#include "guile_ext.hpp"
+#include "guile_object.hpp"
+#include "guile_shared.hpp"
+#include "guile_stats.hpp"
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Per record type information used to pack SRFI-9 records (and any other
+// struct whose vtable is a record type) straight from their slots.
+namespace guile_record {
+
+using record_error = std::runtime_error;
+
+/// A record type registered under a tag.  Tagged records are packed as the
+/// ext id record_tag_ext_id(tag) with a body of the fields in wire order,
+/// and decoded back into an instance of the same type.
+struct record_tag_entry {
+  SCM vtable = SCM_BOOL_F;
+  size_t tag = 0;
+  size_t n_slots = 0;
+  // Struct slot of each field in the order it appears on the wire.
+  std::vector<size_t> wire_slots;
+};
+
+/// Computed once per vtable and never freed.
+struct record_layout {
+  bool is_record = false;
+  std::string type_name;
+  std::vector<std::string> field_names;
+  // Struct slot holding each field, in field order.
+  std::vector<size_t> slots;
+  // For SRFI-69 and R6RS hashtable records, the index of the field holding
+  // the wrapped table, which is packed in place of the record; else -1.
+  int table_field = -1;
+  // Set when the type is registered under a tag.
+  std::atomic<const record_tag_entry *> tagged{nullptr};
+  // Set when an ext packer is registered for this vtable.
+  std::atomic<const guile_ext::pack_handler *> ext_packer{nullptr};
+};
+
+constexpr int8_t record_tag_ext_id(size_t tag) noexcept {
+  return static_cast<int8_t>(guile_shared::record_tag_ext_id_first + tag);
+}
+
+/// Called for every newly computed layout, e.g. to attach a built-in ext
+/// packer to a well known record type.  Hooks are added at module init,
+/// before any packing happens.
+using layout_hook = void (*)(SCM vtable, record_layout &layout);
+
+inline std::vector<layout_hook> &layoutHooks() {
+  static std::vector<layout_hook> hooks;
+  return hooks;
+}
+
+/// Index of the named field in layout.slots, or -1.
+inline int fieldIndex(const record_layout &layout, const std::string &name) {
+  for (size_t i = 0; i < layout.field_names.size(); i++) {
+    if (layout.field_names[i] == name) {
+      return static_cast<int>(i);
+    }
+  }
+  return -1;
+}
+
+namespace detail {
+
+inline SCM guileRef(const char *name) {
+  return scm_c_public_ref("guile", name);
+}
+
+inline std::string utf8Of(SCM str) {
+  size_t len;
+  std::unique_ptr<char, guile_shared::detail::malloc_deleter> buf{
+      scm_to_utf8_stringn(str, &len)};
+  return std::string(buf.get(), len);
+}
+
+inline std::unique_ptr<record_layout> computeLayout(SCM vtable) {
+  static SCM record_type_p = scm_permanent_object(guileRef("record-type?"));
+  static SCM record_type_name =
+      scm_permanent_object(guileRef("record-type-name"));
+  static SCM record_type_fields =
+      scm_permanent_object(guileRef("record-type-fields"));
+
+  auto layout = std::make_unique<record_layout>();
+  if (scm_is_false(scm_call_1(record_type_p, vtable))) {
+    return layout;
+  }
+
+  layout->is_record = true;
+  SCM name = scm_call_1(record_type_name, vtable);
+  layout->type_name =
+      utf8Of(scm_is_symbol(name) ? scm_symbol_to_string(name)
+                                 : scm_object_to_string(name, SCM_UNDEFINED));
+
+  size_t slot = 0;
+  for (SCM fields = scm_call_1(record_type_fields, vtable);
+       scm_is_pair(fields); fields = SCM_CDR(fields), slot++) {
+    layout->field_names.push_back(
+        utf8Of(scm_symbol_to_string(SCM_CAR(fields))));
+    layout->slots.push_back(slot);
+  }
+
+  // Guile's (srfi srfi-69) and (rnrs hashtables) types.  An R6RS table
+  // wraps an SRFI-69 one, which wraps a native or weak table.
+  if (layout->type_name == "srfi-69:hash-table") {
+    layout->table_field = fieldIndex(*layout, "real-table");
+  } else if (layout->type_name == "r6rs:hashtable") {
+    layout->table_field = fieldIndex(*layout, "wrapped-table");
+  }
+
+  for (layout_hook hook : layoutHooks()) {
+    hook(vtable, *layout);
+  }
+  return layout;
+}
+
+} // namespace detail
+
+/// Return the cached layout for a struct's vtable, computing it on first
+/// use.  Safe to call from several Guile threads at once; a per-thread
+/// last-hit entry keeps the common case of runs of one record type lock free.
+inline const record_layout &layoutOfVtable(SCM vtable) {
+  static std::mutex mutex;
+  static std::unordered_map<scm_t_bits, std::unique_ptr<record_layout>> cache;
+  thread_local scm_t_bits last_vtable = 0;
+  thread_local const record_layout *last_layout = nullptr;
+
+  scm_t_bits key = SCM_UNPACK(vtable);
+  if (key == last_vtable) {
+    guile_stats::countLayoutLookup(true);
+    return *last_layout;
+  }
+
+  {
+    std::lock_guard lock(mutex);
+    auto it = cache.find(key);
+    guile_stats::countLayoutLookup(it != cache.end());
+    if (it != cache.end()) {
+      last_vtable = key;
+      last_layout = it->second.get();
+      return *last_layout;
+    }
+  }
+
+  auto layout = detail::computeLayout(vtable);
+
+  std::lock_guard lock(mutex);
+  auto [it, inserted] = cache.emplace(key, std::move(layout));
+  if (inserted) {
+    // The cache is keyed on the vtable's address, so it must never be
+    // collected and reused.
+    scm_gc_protect_object(vtable);
+  }
+  last_vtable = key;
+  last_layout = it->second.get();
+  return *last_layout;
+}
+
+inline const record_layout &layoutOf(SCM value) {
+  return layoutOfVtable(SCM_STRUCT_VTABLE(value));
+}
+
+namespace detail {
+
+struct tag_table {
+  std::mutex mutex;
+  std::array<std::atomic<const record_tag_entry *>,
+             guile_shared::record_tag_count>
+      by_tag{};
+  std::unordered_map<std::string, const record_tag_entry *> by_name;
+};
+
+inline tag_table &tags() {
+  static tag_table *table = new tag_table();
+  return *table;
+}
+
+} // namespace detail
+
+/// Entry registered for an ext id, or null.  Constant time.
+inline const record_tag_entry *entryForExt(int8_t ext_id) noexcept {
+  int tag = ext_id - guile_shared::record_tag_ext_id_first;
+  if (tag < 0 || tag >= static_cast<int>(guile_shared::record_tag_count)) {
+    return nullptr;
+  }
+  return detail::tags().by_tag[tag].load(std::memory_order_acquire);
+}
+
+/// Entry registered for a record type name, or null.  Used for untagged
+/// positional records, which carry their type name instead of a tag.
+inline const record_tag_entry *entryForName(const std::string &name) {
+  auto &table = detail::tags();
+  std::lock_guard lock(table.mutex);
+  auto it = table.by_name.find(name);
+  return it == table.by_name.end() ? nullptr : it->second;
+}
+
+/// Register a record type under tag.  `wire_fields` lists field names in the
+/// order they are written, and defaults to every field in declaration order;
+/// fields left out are not packed and decode as #f.  Registrations are
+/// permanent, and a tag cannot be rebound to a different type.
+inline void registerRecord(SCM vtable, size_t tag, SCM wire_fields) {
+  if (tag >= guile_shared::record_tag_count) {
+    throw record_error("record tag out of range");
+  }
+
+  const record_layout &layout = layoutOfVtable(vtable);
+  if (!layout.is_record) {
+    throw record_error("not a record type");
+  }
+
+  auto entry = std::make_unique<record_tag_entry>();
+  entry->vtable = vtable;
+  entry->tag = tag;
+  entry->n_slots = layout.slots.size();
+  if (SCM_UNBNDP(wire_fields)) {
+    entry->wire_slots = layout.slots;
+  } else {
+    for (; scm_is_pair(wire_fields); wire_fields = SCM_CDR(wire_fields)) {
+      std::string name =
+          detail::utf8Of(scm_symbol_to_string(SCM_CAR(wire_fields)));
+      int i = fieldIndex(layout, name);
+      if (i < 0) {
+        throw record_error("unknown field " + name + " in record type " +
+                           layout.type_name);
+      }
+      entry->wire_slots.push_back(layout.slots[i]);
+    }
+  }
+
+  auto &table = detail::tags();
+  std::lock_guard lock(table.mutex);
+  const record_tag_entry *existing = table.by_tag[tag].load();
+  if (existing != nullptr) {
+    if (!scm_is_eq(existing->vtable, vtable)) {
+      throw record_error("record tag already registered to another type");
+    }
+    return;
+  }
+
+  const record_tag_entry *published = entry.release();
+  table.by_tag[tag].store(published, std::memory_order_release);
+  table.by_name.emplace(layout.type_name, published);
+  const_cast<record_layout &>(layout).tagged.store(published,
+                                                   std::memory_order_release);
+}
+
+/// Pack instances of any struct type, record or not, with an ext handler.
+inline void registerVtablePacker(SCM vtable, guile_ext::pack_handler handler) {
+  const guile_ext::pack_handler *published =
+      guile_ext::makePackHandler(handler);
+  const_cast<record_layout &>(layoutOfVtable(vtable))
+      .ext_packer.store(published, std::memory_order_release);
+}
+
+/// Build an instance of a registered record type from its wire fields.
+/// Slots not on the wire are left #f.  claim(record) is called before any
+/// field is decoded, so that fields referring back to the record resolve.
+template <typename FieldFn, typename ClaimFn>
+inline SCM construct(const record_tag_entry &entry, size_t n_fields,
+                     FieldFn &&field, ClaimFn &&claim) {
+  if (n_fields != entry.wire_slots.size()) {
+    throw record_error("record field count does not match registration");
+  }
+  SCM record = scm_c_make_structv(entry.vtable, 0, 0, nullptr);
+  claim(record);
+  for (size_t i = 0; i < n_fields; i++) {
+    SCM_STRUCT_SLOT_SET(record, entry.wire_slots[i], field(i));
+  }
+  return record;
+}
+
+} // namespace guile_record
@@ -0,0 +1,401 @@
+#pragma once
+
+#include "guile_object.hpp"
+#include "guile_pack.hpp"
+#include "guile_scan.hpp"
+#include "guile_unpack.hpp"
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+
+#include <boost/asio.hpp>
+#include <msgpack.hpp>
+
+// A msgpack-RPC server.  Framing, decoding and packing happen in C++ on an
+// Asio event loop; only the handler procedure registered for a method is
+// called in Scheme.  The loop runs on the Guile thread that calls run(), so
+// handlers are called in Guile mode, one at a time.
+//
+// Requests are [0, msgid, method, params] and get [1, msgid, error, result]
+// back; notifications are [2, method, params] and get nothing.  A client may
+// pipeline any number of requests: every complete message in a read is
+// handled, and their responses leave in order in one write.
+namespace guile_rpc {
+
+using rpc_error = std::runtime_error;
+
+namespace asio = boost::asio;
+
+constexpr uint64_t request_type = 0;
+constexpr uint64_t response_type = 1;
+constexpr uint64_t notification_type = 2;
+
+/// Allocated with scm_gc_malloc, so that `procedures` is scanned, and
+/// destroyed by the foreign object finalizer.
+struct server_state {
+  asio::io_context io;
+  // Vector of handler procedures, indexed by the values of `methods`.
+  SCM procedures = SCM_EOL;
+  std::map<std::string, size_t, std::less<>> methods;
+  guile_pack::flags_type pack_flags;
+  guile_unpack::flags_t unpack_flags;
+
+  server_state(guile_pack::flags_type pf, guile_unpack::flags_t uf)
+      : procedures(scm_c_make_vector(0, SCM_BOOL_F)), pack_flags(pf),
+        unpack_flags(uf) {}
+};
+
+inline SCM server_type = SCM_BOOL_F;
+
+namespace detail {
+
+// Bytes reserved in the decode buffer before each read.
+constexpr size_t read_size = 64 * 1024;
+// Reading pauses while this much output waits behind a write in progress,
+// so a client that pipelines without reading cannot grow it without bound.
+constexpr size_t max_pending_output = 4 * 1024 * 1024;
+
+inline void finalizeServer(SCM server) {
+  auto *st = static_cast<server_state *>(scm_foreign_object_ref(server, 0));
+  st->~server_state();
+}
+
+inline msgpack::unpack_limit limitsOf(const guile_scan::limits &l) {
+  return msgpack::unpack_limit(l.max_container, l.max_container,
+                               l.max_payload, l.max_payload, l.max_payload,
+                               l.max_depth);
+}
+
+inline std::string stringOf(SCM value) {
+  size_t len;
+  std::unique_ptr<char, guile_shared::detail::malloc_deleter> s{
+      scm_to_utf8_stringn(scm_object_to_string(value, SCM_UNDEFINED), &len)};
+  return std::string(s.get(), len);
+}
+
+inline std::string_view methodOf(const msgpack::object &o) {
+  if (o.type == msgpack::type::STR) {
+    return {o.via.str.ptr, o.via.str.size};
+  }
+  if (o.type == msgpack::type::BIN) {
+    return {o.via.bin.ptr, o.via.bin.size};
+  }
+  throw rpc_error("msgpack-RPC method name is not a string");
+}
+
+/// Outcome of one handler call: the packed result is left in the buffer
+/// given to dispatch, or the call failed with the text of an error.
+struct outcome {
+  std::string error;
+  bool failed = false;
+};
+
+/// One handler call, run inside scm_internal_catch from params to packed
+/// result.  `result` is null for a notification, whose result is dropped.
+struct call {
+  server_state *st;
+  const msgpack::object *params;
+  SCM procedure;
+  msgpack::sbuffer *result;
+  outcome out;
+  // (key . args) of a Scheme throw, or false.
+  SCM thrown = SCM_BOOL_F;
+};
+
+inline SCM callBody(void *data) {
+  auto *c = static_cast<call *>(data);
+  try {
+    SCM arguments = scm_vector_to_list(
+        guile_unpack::unpackDocument(*c->params, c->st->unpack_flags));
+    SCM result = scm_apply_0(c->procedure, arguments);
+    if (c->result != nullptr) {
+      msgpack::packer<msgpack::sbuffer> packer(*c->result);
+      guile_pack::packDocument(result, packer, c->st->pack_flags);
+    }
+  } catch (const std::exception &e) {
+    c->out.failed = true;
+    c->out.error = e.what();
+  }
+  return SCM_UNSPECIFIED;
+}
+
+inline SCM callHandler(void *data, SCM key, SCM args) {
+  auto *c = static_cast<call *>(data);
+  c->out.failed = true;
+  c->thrown = scm_cons(key, args);
+  return SCM_UNSPECIFIED;
+}
+
+/// Decode the params, apply the method's procedure to them and pack the
+/// result into `result`, which is cleared first.  Everything that can throw
+/// in Scheme runs inside the catch, so nothing unwinds through Asio frames;
+/// C++ exceptions and Scheme throws both become failed outcomes.
+inline outcome dispatch(server_state &st, const msgpack::object &method,
+                        const msgpack::object &params,
+                        msgpack::sbuffer *result) {
+  if (result != nullptr) {
+    result->clear();
+  }
+  try {
+    std::string_view name = methodOf(method);
+    auto it = st.methods.find(name);
+    if (it == st.methods.end()) {
+      throw rpc_error("no such method: " + std::string(name));
+    }
+    if (params.type != msgpack::type::ARRAY) {
+      throw rpc_error("msgpack-RPC params are not an array");
+    }
+    call c{&st, &params, SCM_SIMPLE_VECTOR_REF(st.procedures, it->second),
+           result, outcome{}, SCM_BOOL_F};
+    scm_internal_catch(SCM_BOOL_T, callBody, &c, callHandler, &c);
+    if (scm_is_true(c.thrown)) {
+      c.out.error = stringOf(c.thrown);
+    }
+    return c.out;
+  } catch (const std::exception &e) {
+    return outcome{e.what(), true};
+  }
+}
+
+template <typename Protocol>
+class connection : public std::enable_shared_from_this<connection<Protocol>> {
+public:
+  using socket_type = typename Protocol::socket;
+
+  connection(server_state &st, socket_type socket)
+      : st_(st), socket_(std::move(socket)),
+        unpacker_(nullptr, nullptr, read_size,
+                  limitsOf(guile_scan::currentLimits())) {}
+
+  void start() { read(); }
+
+private:
+  void read() {
+    if (reading_) {
+      return;
+    }
+    reading_ = true;
+    unpacker_.reserve_buffer(read_size);
+    auto self = this->shared_from_this();
+    socket_.async_read_some(
+        asio::buffer(unpacker_.buffer(), unpacker_.buffer_capacity()),
+        [self](const boost::system::error_code &ec, size_t n) {
+          self->reading_ = false;
+          if (ec) {
+            return;
+          }
+          self->unpacker_.buffer_consumed(n);
+          if (!self->handleAll()) {
+            self->socket_.close();
+            return;
+          }
+          self->flush();
+          if (self->out_.size() < max_pending_output) {
+            self->read();
+          }
+        });
+  }
+
+  /// Handle every complete message in the decode buffer.  Returns false on
+  /// a protocol error, after which the connection is closed.
+  bool handleAll() {
+    try {
+      msgpack::object_handle handle;
+      while (unpacker_.next(handle)) {
+        if (!handleMessage(handle.get())) {
+          return false;
+        }
+      }
+    } catch (const std::exception &) {
+      // Malformed input or a limit exceeded; the stream cannot be resynced.
+      return false;
+    }
+    return true;
+  }
+
+  bool handleMessage(const msgpack::object &msg) {
+    if (msg.type != msgpack::type::ARRAY || msg.via.array.size < 3 ||
+        msg.via.array.ptr[0].type != msgpack::type::POSITIVE_INTEGER) {
+      return false;
+    }
+    const msgpack::object *field = msg.via.array.ptr;
+
+    switch (field[0].via.u64) {
+    case request_type: {
+      if (msg.via.array.size != 4 ||
+          field[1].type != msgpack::type::POSITIVE_INTEGER) {
+        return false;
+      }
+      respond(field[1].via.u64, dispatch(st_, field[2], field[3], &scratch_));
+      return true;
+    }
+    case notification_type:
+      if (msg.via.array.size != 3) {
+        return false;
+      }
+      dispatch(st_, field[1], field[2], nullptr);
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  /// The result was packed into scratch_ by dispatch, so a value that fails
+  /// to pack leaves no partial response in the output.
+  void respond(uint64_t msgid, const outcome &sent) {
+    msgpack::packer<msgpack::sbuffer> packer(out_);
+    packer.pack_array(4);
+    packer.pack_uint64(response_type);
+    packer.pack_uint64(msgid);
+    if (sent.failed) {
+      packer.pack(sent.error);
+      packer.pack_nil();
+    } else {
+      packer.pack_nil();
+      out_.write(scratch_.data(), scratch_.size());
+    }
+  }
+
+  void flush() {
+    if (writing_ || out_.size() == 0) {
+      return;
+    }
+    writing_ = true;
+    std::swap(out_, sending_);
+    auto self = this->shared_from_this();
+    asio::async_write(
+        socket_, asio::buffer(sending_.data(), sending_.size()),
+        [self](const boost::system::error_code &ec, size_t) {
+          self->writing_ = false;
+          self->sending_.clear();
+          if (ec) {
+            self->socket_.close();
+            return;
+          }
+          self->flush();
+          if (self->out_.size() < max_pending_output && self->socket_.is_open()) {
+            self->read();
+          }
+        });
+  }
+
+  server_state &st_;
+  socket_type socket_;
+  msgpack::unpacker unpacker_;
+  // Responses not yet handed to a write, and those of the write in flight.
+  msgpack::sbuffer out_;
+  msgpack::sbuffer sending_;
+  msgpack::sbuffer scratch_;
+  bool reading_ = false;
+  bool writing_ = false;
+};
+
+template <typename Protocol>
+void accept(server_state &st,
+            std::shared_ptr<typename Protocol::acceptor> acceptor) {
+  acceptor->async_accept([&st, acceptor](const boost::system::error_code &ec,
+                                         typename Protocol::socket socket) {
+    if (ec == asio::error::operation_aborted) {
+      return;
+    }
+    if (!ec) {
+      std::make_shared<connection<Protocol>>(st, std::move(socket))->start();
+    }
+    accept<Protocol>(st, acceptor);
+  });
+}
+
+} // namespace detail
+
+inline void initServerType() {
+  server_type = scm_make_foreign_object_type(
+      scm_from_utf8_symbol("msgpack-rpc-server"),
+      scm_list_1(scm_from_utf8_symbol("state")), detail::finalizeServer);
+}
+
+inline SCM makeServer(guile_pack::flags_type pack_flags,
+                      guile_unpack::flags_t unpack_flags) {
+  void *mem = scm_gc_malloc(sizeof(server_state), "msgpack-rpc-server");
+  auto *st = new (mem) server_state(pack_flags, unpack_flags);
+  return scm_make_foreign_object_1(server_type, st);
+}
+
+inline server_state &stateOf(SCM server) {
+  scm_assert_foreign_object_type(server_type, server);
+  return *static_cast<server_state *>(scm_foreign_object_ref(server, 0));
+}
+
+/// Register or replace the procedure called for `method`.  It is applied to
+/// the elements of the request's params array.
+inline void registerMethod(server_state &st, std::string_view method,
+                           SCM procedure) {
+  auto it = st.methods.find(method);
+  if (it != st.methods.end()) {
+    SCM_SIMPLE_VECTOR_SET(st.procedures, it->second, procedure);
+    return;
+  }
+
+  size_t n = SCM_SIMPLE_VECTOR_LENGTH(st.procedures);
+  SCM grown = scm_c_make_vector(n + 1, SCM_BOOL_F);
+  for (size_t i = 0; i < n; i++) {
+    SCM_SIMPLE_VECTOR_SET(grown, i, SCM_SIMPLE_VECTOR_REF(st.procedures, i));
+  }
+  SCM_SIMPLE_VECTOR_SET(grown, n, procedure);
+  st.procedures = grown;
+  st.methods.emplace(std::string(method), n);
+}
+
+/// Listen on a Unix socket.  A stale socket file at `path`, one nothing
+/// accepts connections on, is replaced; a live one or any other file there
+/// is an error.
+inline void listenUnix(server_state &st, const std::string &path) {
+  using protocol = asio::local::stream_protocol;
+  struct stat sb;
+  if (::lstat(path.c_str(), &sb) == 0 && S_ISSOCK(sb.st_mode)) {
+    protocol::socket probe(st.io);
+    boost::system::error_code ec;
+    probe.connect(protocol::endpoint(path), ec);
+    if (!ec) {
+      throw rpc_error("another server is listening on " + path);
+    }
+    if (ec == asio::error::connection_refused) {
+      ::unlink(path.c_str());
+    }
+  }
+  auto acceptor = std::make_shared<protocol::acceptor>(
+      st.io, protocol::endpoint(path));
+  detail::accept<protocol>(st, acceptor);
+}
+
+/// Listen on a TCP address.  Returns the bound port, which is chosen by the
+/// system when `port` is 0.
+inline uint16_t listenTcp(server_state &st, const std::string &host,
+                          uint16_t port) {
+  using protocol = asio::ip::tcp;
+  protocol::endpoint endpoint(asio::ip::make_address(host), port);
+  auto acceptor = std::make_shared<protocol::acceptor>(st.io, endpoint);
+  detail::accept<protocol>(st, acceptor);
+  return acceptor->local_endpoint().port();
+}
+
+/// Serve on the calling thread until stop() is called.  A stop() that
+/// comes before run() makes it return at once.
+inline void run(server_state &st) {
+  auto guard = asio::make_work_guard(st.io);
+  st.io.run();
+  st.io.restart();
+}
+
+/// Make run() return.  Safe to call from any thread, and from a handler.
+inline void stop(server_state &st) { st.io.stop(); }
+
+} // namespace guile_rpc
@@ -0,0 +1,336 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bitset>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include <msgpack.hpp>
+
+// Structural scanning of encoded msgpack: reads headers and walks past whole
+// objects by length arithmetic, without building a msgpack::object tree or
+// touching Guile.
+namespace guile_scan {
+
+using scan_error = std::runtime_error;
+
+struct header {
+  msgpack::type::object_type type;
+  // Bytes taken by the marker and any length or type fields.
+  uint32_t header_size;
+  // Bytes of inline payload following the header (string/bin/ext bodies and
+  // scalar values that are not encoded in the marker itself).  64 bits,
+  // since an ext32 payload is its 32 bit length plus the type byte.
+  uint64_t payload_size;
+  // Number of child objects that follow (elements, or keys plus values).
+  uint64_t children;
+  // Element or pair count for containers, 0 otherwise.
+  uint32_t count;
+};
+
+namespace detail {
+
+inline uint64_t readBE(const unsigned char *p, size_t n) noexcept {
+  uint64_t v = 0;
+  for (size_t i = 0; i < n; i++) {
+    v = (v << 8) | p[i];
+  }
+  return v;
+}
+
+} // namespace detail
+
+/// Decode the header of the object starting at data[pos].  Throws when the
+/// header itself or its inline payload runs past len.
+inline header readHeader(const char *data, size_t len, size_t pos) {
+  using msgpack::type::object_type;
+  if (pos >= len) {
+    throw scan_error("truncated msgpack input");
+  }
+
+  const auto *p = reinterpret_cast<const unsigned char *>(data) + pos;
+  size_t avail = len - pos;
+  unsigned char m = p[0];
+  header h{object_type::NIL, 1, 0, 0, 0};
+
+  // Reads an n byte big endian length field following the marker.
+  auto field = [&](size_t n) -> uint64_t {
+    if (avail < 1 + n) {
+      throw scan_error("truncated msgpack header");
+    }
+    h.header_size = 1 + n;
+    return detail::readBE(p + 1, n);
+  };
+  auto container = [&](object_type t, uint64_t n) {
+    h.type = t;
+    h.count = static_cast<uint32_t>(n);
+    h.children = t == object_type::MAP ? 2 * n : n;
+  };
+
+  if (m <= 0x7f) {
+    h.type = object_type::POSITIVE_INTEGER;
+  } else if (m <= 0x8f) {
+    container(object_type::MAP, m & 0x0f);
+  } else if (m <= 0x9f) {
+    container(object_type::ARRAY, m & 0x0f);
+  } else if (m <= 0xbf) {
+    h.type = object_type::STR;
+    h.payload_size = m & 0x1f;
+  } else if (m >= 0xe0) {
+    h.type = object_type::NEGATIVE_INTEGER;
+  } else {
+    switch (m) {
+    case 0xc0:
+      h.type = object_type::NIL;
+      break;
+    case 0xc2:
+    case 0xc3:
+      h.type = object_type::BOOLEAN;
+      break;
+    case 0xc4:
+    case 0xc5:
+    case 0xc6:
+      h.type = object_type::BIN;
+      h.payload_size = field(size_t{1} << (m - 0xc4));
+      break;
+    case 0xc7:
+    case 0xc8:
+    case 0xc9:
+      h.type = object_type::EXT;
+      h.payload_size = field(size_t{1} << (m - 0xc7)) + 1;
+      break;
+    case 0xca:
+      h.type = object_type::FLOAT32;
+      h.payload_size = 4;
+      break;
+    case 0xcb:
+      h.type = object_type::FLOAT64;
+      h.payload_size = 8;
+      break;
+    case 0xcc:
+    case 0xcd:
+    case 0xce:
+    case 0xcf:
+      h.type = object_type::POSITIVE_INTEGER;
+      h.payload_size = 1 << (m - 0xcc);
+      break;
+    case 0xd0:
+    case 0xd1:
+    case 0xd2:
+    case 0xd3:
+      h.type = object_type::NEGATIVE_INTEGER;
+      h.payload_size = 1 << (m - 0xd0);
+      break;
+    case 0xd4:
+    case 0xd5:
+    case 0xd6:
+    case 0xd7:
+    case 0xd8:
+      h.type = object_type::EXT;
+      h.payload_size = (1 << (m - 0xd4)) + 1;
+      break;
+    case 0xd9:
+    case 0xda:
+    case 0xdb:
+      h.type = object_type::STR;
+      h.payload_size = field(size_t{1} << (m - 0xd9));
+      break;
+    case 0xdc:
+    case 0xdd:
+      container(object_type::ARRAY, field(m == 0xdc ? 2 : 4));
+      break;
+    case 0xde:
+    case 0xdf:
+      container(object_type::MAP, field(m == 0xde ? 2 : 4));
+      break;
+    default:
+      throw scan_error("invalid msgpack marker byte");
+    }
+  }
+
+  if (avail - h.header_size < h.payload_size) {
+    throw scan_error("truncated msgpack payload");
+  }
+  return h;
+}
+
+/// Return the offset just past the complete object starting at data[pos].
+/// Iterative, so nesting depth costs nothing.
+inline size_t skip(const char *data, size_t len, size_t pos) {
+  uint64_t pending = 1;
+  while (pending > 0) {
+    header h = readHeader(data, len, pos);
+    pos += h.header_size + h.payload_size;
+    pending += h.children;
+    pending--;
+    // Every remaining object needs at least one byte.
+    if (pending > len - pos) {
+      throw scan_error("msgpack container length exceeds input");
+    }
+  }
+  return pos;
+}
+
+/// Find the start offset of each element of the array starting at
+/// data[pos].  A final entry holds the offset just past the last element.
+/// Returns false, leaving offsets empty, when the object is not an array.
+inline bool arrayElementOffsets(const char *data, size_t len, size_t pos,
+                                std::vector<size_t> &offsets) {
+  header h = readHeader(data, len, pos);
+  if (h.type != msgpack::type::object_type::ARRAY) {
+    return false;
+  }
+  pos += h.header_size;
+  if (h.count > len - pos) {
+    throw scan_error("msgpack container length exceeds input");
+  }
+
+  offsets.reserve(h.count + 1);
+  for (uint32_t i = 0; i < h.count; i++) {
+    offsets.push_back(pos);
+    pos = skip(data, len, pos);
+  }
+  offsets.push_back(pos);
+  return true;
+}
+
+/// A set of ext types, indexed by the type byte.
+using ext_set = std::bitset<256>;
+
+/// Collect the type of every ext in the object at data[pos] into `seen`,
+/// looking inside the bodies of those whose type is in `nested` too.  A
+/// nested body that does not parse as msgpack is left opaque.  Iterative,
+/// like skip(), however deeply bodies nest.
+inline void collectExtTypes(const char *data, size_t len, size_t pos,
+                            const ext_set &nested, ext_set &seen) {
+  struct region {
+    const char *data;
+    size_t len;
+    size_t pos;
+    // A nested body, which holds any number of objects rather than one.
+    bool whole_body;
+  };
+  std::vector<region> work{{data, len, pos, false}};
+
+  while (!work.empty()) {
+    region r = work.back();
+    work.pop_back();
+    try {
+      uint64_t pending = r.pos < r.len || !r.whole_body ? 1 : 0;
+      while (pending > 0) {
+        header h = readHeader(r.data, r.len, r.pos);
+        if (h.type == msgpack::type::object_type::EXT) {
+          auto type = static_cast<unsigned char>(r.data[r.pos + h.header_size]);
+          seen.set(type);
+          if (nested.test(type)) {
+            work.push_back({r.data + r.pos + h.header_size + 1,
+                            h.payload_size - 1, 0, true});
+          }
+        }
+        r.pos += h.header_size + h.payload_size;
+        pending += h.children;
+        pending--;
+        if (pending == 0 && r.whole_body && r.pos < r.len) {
+          pending = 1;
+        }
+        if (pending > r.len - r.pos) {
+          throw scan_error("msgpack container length exceeds input");
+        }
+      }
+    } catch (const scan_error &) {
+      if (!r.whole_body) {
+        throw;
+      }
+    }
+  }
+}
+
+/// Bounds enforced by validate().
+struct limits {
+  uint32_t max_depth = 512;
+  // Elements of an array or pairs of a map.
+  uint32_t max_container = uint32_t{1} << 24;
+  // Payload of a single string, binary or ext.
+  uint32_t max_payload = uint32_t{1} << 30;
+};
+
+/// Process wide limits applied before decoding.  Replaced limits are leaked,
+/// since another thread may still be reading them.
+inline std::atomic<const limits *> &currentLimitsSlot() {
+  static std::atomic<const limits *> slot{new limits()};
+  return slot;
+}
+
+inline const limits &currentLimits() {
+  return *currentLimitsSlot().load(std::memory_order_acquire);
+}
+
+inline void setLimits(const limits &l) {
+  currentLimitsSlot().store(new limits(l), std::memory_order_release);
+}
+
+struct summary {
+  // Offset just past the object.
+  size_t end;
+  // Objects of every kind, containers included.
+  uint64_t objects;
+  uint32_t depth;
+};
+
+/// Check the structure of the object at data[pos] without building
+/// anything: every header and payload fits in the input, no container claims
+/// more children than there are bytes left, and nothing exceeds `lim`.  A
+/// single forward pass, so hostile length prefixes are rejected in time
+/// linear in the input and before any decoder allocates for them.
+inline summary validate(const char *data, size_t len, size_t pos,
+                        const limits &lim) {
+  using msgpack::type::object_type;
+  summary s{pos, 0, 0};
+  // Objects still to read at each open nesting level.
+  std::vector<uint64_t> remaining{1};
+  uint64_t pending = 1;
+
+  while (!remaining.empty()) {
+    if (remaining.back() == 0) {
+      remaining.pop_back();
+      continue;
+    }
+    remaining.back()--;
+    pending--;
+
+    header h = readHeader(data, len, pos);
+    s.objects++;
+    pos += h.header_size + h.payload_size;
+
+    bool has_payload = h.type == object_type::STR ||
+                       h.type == object_type::BIN ||
+                       h.type == object_type::EXT;
+    if (has_payload && h.payload_size > lim.max_payload) {
+      throw scan_error("msgpack payload exceeds limit");
+    }
+
+    if (h.children > 0) {
+      if (h.count > lim.max_container) {
+        throw scan_error("msgpack container exceeds limit");
+      }
+      if (remaining.size() >= lim.max_depth) {
+        throw scan_error("msgpack nesting exceeds limit");
+      }
+      remaining.push_back(h.children);
+      pending += h.children;
+      s.depth = std::max<uint32_t>(s.depth, remaining.size() - 1);
+    }
+    // Every remaining object needs at least one byte.
+    if (pending > len - pos) {
+      throw scan_error("msgpack container length exceeds input");
+    }
+  }
+
+  s.end = pos;
+  return s;
+}
+
+} // namespace guile_scan
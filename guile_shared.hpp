@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstdlib>
+#include <libguile.h>
 #include <msgpack.hpp>
 #include <string_view>
 
@@ -17,11 +18,56 @@ struct malloc_deleter {
   void operator()(char *v) noexcept { ::free(v); }
 };
 
+// Reference mode for msgpack::unpack: STR/BIN/EXT payloads point into the
+// source bytes instead of being copied into the zone.  Only valid while the
+// source outlives the object tree.
+inline bool referenceAll(msgpack::type::object_type, std::size_t, void *) {
+  return true;
+}
+
 } // namespace detail
+
+/// A dynwind context spanning one C++ frame that a Scheme throw may leave.
+/// The longjmp of a throw skips C++ destructors, so objects handed to
+/// destroy() are destroyed by an unwind handler instead; on a normal return
+/// or a C++ exception they are destroyed as usual.  Declare the scope before
+/// the objects it guards.
+class unwind_scope {
+public:
+  unwind_scope() { scm_dynwind_begin(static_cast<scm_t_dynwind_flags>(0)); }
+  unwind_scope(const unwind_scope &) = delete;
+  unwind_scope &operator=(const unwind_scope &) = delete;
+  ~unwind_scope() { scm_dynwind_end(); }
+
+  template <typename T> T &destroy(T &object) {
+    scm_dynwind_unwind_handler([](void *p) { static_cast<T *>(p)->~T(); },
+                               &object, static_cast<scm_t_wind_flags>(0));
+    return object;
+  }
+};
   //
+// Defined by the msgpack spec.
+constexpr const int8_t timestamp_ext_id = -1;
+
 constexpr const int8_t nil_ext_id = GUILE_PACK_EXT_ID_START;
 constexpr const int8_t symbol_ext_id = GUILE_PACK_EXT_ID_START + 1;
 constexpr const int8_t keyword_ext_id = GUILE_PACK_EXT_ID_START + 2;
+constexpr const int8_t record_ext_id = GUILE_PACK_EXT_ID_START + 3;
+
+// Shared structure: a definition carries [index, object], later occurrences
+// of the same object are a reference carrying just the index.
+constexpr const int8_t shared_def_ext_id = GUILE_PACK_EXT_ID_START + 4;
+constexpr const int8_t shared_ref_ext_id = GUILE_PACK_EXT_ID_START + 5;
+
+// A whole document compressed with guile_lz: the uncompressed size as a
+// big endian uint32, then one compressed block.
+constexpr const int8_t compressed_ext_id = GUILE_PACK_EXT_ID_START + 6;
+
+// Tagged record types registered from Scheme take one ext id each.
+constexpr const int8_t record_tag_ext_id_first = GUILE_PACK_EXT_ID_START + 8;
+constexpr const size_t record_tag_count = 16;
+static_assert(GUILE_PACK_EXT_ID_START + 8 + record_tag_count - 1 <= 127,
+              "GUILE_PACK_EXT_ID_START leaves no room for record tags");
 
 [[noreturn]] inline void panic() { std::exit(1); }
 
@@ -0,0 +1,285 @@
+#pragma once
+
+#include "guile_object.hpp"
+#include "guile_shared.hpp"
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <msgpack.hpp>
+
+// Runtime counters for the pack and unpack paths, compiled in only when
+// GUILE_MPACK_STATS is non-zero (meson -Dstats=true).  Otherwise every hook
+// is an empty inline function.
+//
+// Each thread counts into its own block so that the hot path never contends
+// on a shared cache line; readers sum the blocks.  Blocks outlive their
+// threads so that nothing counted is lost.
+#ifndef GUILE_MPACK_STATS
+#define GUILE_MPACK_STATS 0
+#endif
+
+// One in this many pack and unpack documents is timed.  0 disables timing.
+#ifndef GUILE_MPACK_STATS_SAMPLE_PERIOD
+#define GUILE_MPACK_STATS_SAMPLE_PERIOD 64
+#endif
+
+namespace guile_stats {
+
+constexpr bool enabled = GUILE_MPACK_STATS != 0;
+
+constexpr size_t guile_type_count =
+    static_cast<size_t>(guile_object::guile_type::invalid) + 1;
+// msgpack::type::object_type values are all below 16.
+constexpr size_t msgpack_type_count = 16;
+// Bucket i counts durations of less than 2^i nanoseconds.
+constexpr size_t histogram_buckets = 32;
+
+namespace detail {
+
+using counter = std::atomic<uint64_t>;
+
+// Only the owning thread writes, so a relaxed load and store is enough.
+inline void bump(counter &c, uint64_t n = 1) noexcept {
+  c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+struct block {
+  std::array<counter, guile_type_count> packed_by_type{};
+  std::array<counter, msgpack_type_count> unpacked_by_type{};
+  counter bytes_packed{0};
+  counter unknown_fallbacks{0};
+  counter layout_cache_hits{0};
+  counter layout_cache_misses{0};
+  std::array<counter, histogram_buckets> pack_ns{};
+  std::array<counter, histogram_buckets> unpack_ns{};
+};
+
+struct registry {
+  std::mutex mutex;
+  std::vector<block *> blocks;
+};
+
+inline registry &blocks() {
+  static registry *r = new registry();
+  return *r;
+}
+
+inline block &local() {
+  thread_local block *mine = [] {
+    auto *b = new block();
+    auto &r = blocks();
+    std::lock_guard lock(r.mutex);
+    r.blocks.push_back(b);
+    return b;
+  }();
+  return *mine;
+}
+
+} // namespace detail
+
+inline void countPack(guile_object::guile_type gt) noexcept {
+  if constexpr (enabled) {
+    detail::bump(detail::local().packed_by_type[static_cast<size_t>(gt)]);
+  }
+}
+
+inline void countUnpack(msgpack::type::object_type type) noexcept {
+  if constexpr (enabled) {
+    detail::bump(detail::local().unpacked_by_type[static_cast<size_t>(type) %
+                                                  msgpack_type_count]);
+  }
+}
+
+inline void countPackedBytes(size_t n) noexcept {
+  if constexpr (enabled) {
+    detail::bump(detail::local().bytes_packed, n);
+  }
+}
+
+inline void countFallback() noexcept {
+  if constexpr (enabled) {
+    detail::bump(detail::local().unknown_fallbacks);
+  }
+}
+
+inline void countLayoutLookup(bool hit) noexcept {
+  if constexpr (enabled) {
+    detail::bump(hit ? detail::local().layout_cache_hits
+                     : detail::local().layout_cache_misses);
+  }
+}
+
+enum class timing { pack, unpack };
+
+/// Times the enclosing scope for one in GUILE_MPACK_STATS_SAMPLE_PERIOD
+/// documents per thread.
+class sampled_timer {
+public:
+  explicit sampled_timer(timing which) noexcept : which_(which) {
+    if constexpr (enabled && GUILE_MPACK_STATS_SAMPLE_PERIOD > 0) {
+      thread_local uint32_t tick = 0;
+      if (++tick % GUILE_MPACK_STATS_SAMPLE_PERIOD == 0) {
+        sampled_ = true;
+        start_ = std::chrono::steady_clock::now();
+      }
+    }
+  }
+  sampled_timer(const sampled_timer &) = delete;
+  sampled_timer &operator=(const sampled_timer &) = delete;
+
+  ~sampled_timer() {
+    if constexpr (enabled && GUILE_MPACK_STATS_SAMPLE_PERIOD > 0) {
+      if (!sampled_) {
+        return;
+      }
+      uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - start_)
+                        .count();
+      size_t bucket = std::min<size_t>(std::bit_width(ns),
+                                       histogram_buckets - 1);
+      auto &b = detail::local();
+      detail::bump(which_ == timing::pack ? b.pack_ns[bucket]
+                                          : b.unpack_ns[bucket]);
+    }
+  }
+
+private:
+  timing which_;
+  bool sampled_ = false;
+  std::chrono::steady_clock::time_point start_;
+};
+
+/// Zero every counter.  Increments racing with the reset may survive it.
+inline void reset() {
+  auto &r = detail::blocks();
+  std::lock_guard lock(r.mutex);
+  for (auto *b : r.blocks) {
+    for (auto &c : b->packed_by_type) {
+      c.store(0, std::memory_order_relaxed);
+    }
+    for (auto &c : b->unpacked_by_type) {
+      c.store(0, std::memory_order_relaxed);
+    }
+    for (auto &c : b->pack_ns) {
+      c.store(0, std::memory_order_relaxed);
+    }
+    for (auto &c : b->unpack_ns) {
+      c.store(0, std::memory_order_relaxed);
+    }
+    b->bytes_packed.store(0, std::memory_order_relaxed);
+    b->unknown_fallbacks.store(0, std::memory_order_relaxed);
+    b->layout_cache_hits.store(0, std::memory_order_relaxed);
+    b->layout_cache_misses.store(0, std::memory_order_relaxed);
+  }
+}
+
+namespace detail {
+
+template <size_t N, typename Field>
+inline std::array<uint64_t, N> sum(Field field) {
+  std::array<uint64_t, N> total{};
+  for (auto *b : blocks().blocks) {
+    auto &counters = field(*b);
+    for (size_t i = 0; i < N; i++) {
+      total[i] += counters[i].load(std::memory_order_relaxed);
+    }
+  }
+  return total;
+}
+
+inline SCM symbolOf(std::string_view name) {
+  std::string lower(name);
+  for (auto &c : lower) {
+    c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    if (c == '_') {
+      c = '-';
+    }
+  }
+  return scm_from_utf8_symboln(lower.data(), lower.size());
+}
+
+inline SCM entry(const char *name, SCM value) {
+  return scm_cons(scm_from_utf8_symbol(name), value);
+}
+
+inline SCM histogramOf(const std::array<uint64_t, histogram_buckets> &h) {
+  SCM v = scm_c_make_vector(histogram_buckets, SCM_INUM0);
+  for (size_t i = 0; i < histogram_buckets; i++) {
+    SCM_SIMPLE_VECTOR_SET(v, i, scm_from_uint64(h[i]));
+  }
+  return v;
+}
+
+} // namespace detail
+
+/// All counters as an alist.  Per-type counts list only the types seen.
+/// Timing histograms are vectors whose slot i counts documents that took
+/// less than 2^i ns.
+inline SCM toAlist() {
+  if constexpr (!enabled) {
+    return scm_list_1(detail::entry("enabled", SCM_BOOL_F));
+  }
+
+  auto &r = detail::blocks();
+  std::lock_guard lock(r.mutex);
+
+  auto packed = detail::sum<guile_type_count>(
+      [](detail::block &b) -> auto & { return b.packed_by_type; });
+  auto unpacked = detail::sum<msgpack_type_count>(
+      [](detail::block &b) -> auto & { return b.unpacked_by_type; });
+  auto pack_ns = detail::sum<histogram_buckets>(
+      [](detail::block &b) -> auto & { return b.pack_ns; });
+  auto unpack_ns = detail::sum<histogram_buckets>(
+      [](detail::block &b) -> auto & { return b.unpack_ns; });
+
+  uint64_t bytes = 0, fallbacks = 0, hits = 0, misses = 0;
+  for (auto *b : r.blocks) {
+    bytes += b->bytes_packed.load(std::memory_order_relaxed);
+    fallbacks += b->unknown_fallbacks.load(std::memory_order_relaxed);
+    hits += b->layout_cache_hits.load(std::memory_order_relaxed);
+    misses += b->layout_cache_misses.load(std::memory_order_relaxed);
+  }
+
+  SCM pack_types = SCM_EOL;
+  for (size_t i = guile_type_count; i-- > 0;) {
+    if (packed[i] != 0) {
+      pack_types = scm_acons(
+          detail::symbolOf(guile_object::display(
+              static_cast<guile_object::guile_type>(i))),
+          scm_from_uint64(packed[i]), pack_types);
+    }
+  }
+
+  SCM unpack_types = SCM_EOL;
+  for (size_t i = msgpack_type_count; i-- > 0;) {
+    if (unpacked[i] != 0) {
+      unpack_types = scm_acons(
+          detail::symbolOf(guile_shared::display(
+              static_cast<msgpack::type::object_type>(i))),
+          scm_from_uint64(unpacked[i]), unpack_types);
+    }
+  }
+
+  return scm_list_n(detail::entry("enabled", SCM_BOOL_T),
+                    detail::entry("pack-types", pack_types),
+                    detail::entry("unpack-types", unpack_types),
+                    detail::entry("bytes-packed", scm_from_uint64(bytes)),
+                    detail::entry("unknown-fallbacks",
+                                  scm_from_uint64(fallbacks)),
+                    detail::entry("layout-cache-hits", scm_from_uint64(hits)),
+                    detail::entry("layout-cache-misses",
+                                  scm_from_uint64(misses)),
+                    detail::entry("pack-time-ns", detail::histogramOf(pack_ns)),
+                    detail::entry("unpack-time-ns",
+                                  detail::histogramOf(unpack_ns)),
+                    SCM_UNDEFINED);
+}
+
+} // namespace guile_stats
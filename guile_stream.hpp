@@ -0,0 +1,232 @@
+#pragma once
+
+#include "guile_object.hpp"
+#include "guile_pack.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <new>
+#include <stdexcept>
+#include <vector>
+
+#include <msgpack.hpp>
+
+// Incremental packing to a Scheme port.  Arrays and maps are opened with a
+// declared element count, or on a seekable port without one, in which case
+// a 32 bit header is written and patched with the real count when the
+// container is closed.  Elements are packed one at a time, so a sequence
+// produced by a generator never has to exist in memory as a whole.
+namespace guile_stream {
+
+using stream_error = std::runtime_error;
+
+struct frame {
+  bool is_map;
+  // Header written as a placeholder, to be patched on end.
+  bool patched;
+  uint64_t declared;
+  // Elements so far; keys and values count separately in maps.
+  uint64_t written;
+  // Port offset of the placeholder header.
+  int64_t header_pos;
+};
+
+/// Allocated with scm_gc_malloc, so that `port` stays reachable while the
+/// writer is, and destroyed by the foreign object finalizer.
+struct writer_state {
+  SCM port;
+  guile_pack::flags_type flags;
+  // Output not yet handed to the port.
+  msgpack::sbuffer batch;
+  std::vector<frame> frames;
+  bool failed = false;
+};
+
+inline SCM writer_type = SCM_BOOL_F;
+
+namespace detail {
+
+// Output is handed to the port in chunks of about this size, and whenever
+// a top-level value is complete.
+constexpr size_t flush_threshold = 64 * 1024;
+
+inline void finalizeWriter(SCM writer) {
+  auto *st = static_cast<writer_state *>(scm_foreign_object_ref(writer, 0));
+  st->~writer_state();
+}
+
+/// A port error may leave part of the batch written, so the writer is
+/// failed until the write returns.
+inline void flush(writer_state &st) {
+  if (st.batch.size() > 0) {
+    st.failed = true;
+    scm_c_write(st.port, st.batch.data(), st.batch.size());
+    st.batch.clear();
+    st.failed = false;
+  }
+}
+
+inline void flushIfDue(writer_state &st) {
+  if (st.frames.empty() || st.batch.size() >= flush_threshold) {
+    flush(st);
+  }
+}
+
+inline SCM tellBody(void *port) {
+  return scm_seek(*static_cast<SCM *>(port), SCM_INUM0,
+                  scm_from_int(SEEK_CUR));
+}
+
+inline SCM tellHandler(void *, SCM, SCM) { return SCM_BOOL_F; }
+
+/// Current offset of port, or -1 when it cannot seek.
+inline int64_t tell(SCM port) {
+  SCM pos =
+      scm_internal_catch(SCM_BOOL_T, tellBody, &port, tellHandler, nullptr);
+  return scm_is_false(pos) ? -1 : scm_to_int64(pos);
+}
+
+inline void checkUsable(const writer_state &st) {
+  if (st.failed) {
+    throw stream_error("msgpack writer is unusable after an error");
+  }
+}
+
+/// Throws when the open container has no room for another element.
+inline void checkRoom(const writer_state &st) {
+  if (st.frames.empty()) {
+    return;
+  }
+  const frame &f = st.frames.back();
+  if (!f.patched && f.written == (f.is_map ? 2 * f.declared : f.declared)) {
+    throw stream_error("more elements written than declared");
+  }
+}
+
+inline void countElement(writer_state &st) {
+  if (!st.frames.empty()) {
+    st.frames.back().written++;
+  }
+}
+
+} // namespace detail
+
+inline void initWriterType() {
+  writer_type = scm_make_foreign_object_type(
+      scm_from_utf8_symbol("msgpack-writer"),
+      scm_list_1(scm_from_utf8_symbol("state")), detail::finalizeWriter);
+}
+
+inline SCM makeWriter(SCM port, guile_pack::flags_type flags) {
+  void *mem = scm_gc_malloc(sizeof(writer_state), "msgpack-writer");
+  auto *st = new (mem) writer_state{port, flags, {}, {}, false};
+  return scm_make_foreign_object_1(writer_type, st);
+}
+
+inline writer_state &stateOf(SCM writer) {
+  scm_assert_foreign_object_type(writer_type, writer);
+  return *static_cast<writer_state *>(scm_foreign_object_ref(writer, 0));
+}
+
+/// Pack one value as the next element of the open container, or as a
+/// top-level document when none is open.
+inline void write(writer_state &st, SCM value) {
+  detail::checkUsable(st);
+  detail::checkRoom(st);
+  // Part of the value may be in the batch when packing fails, and a Scheme
+  // throw would unwind past any C++ handler here, so the writer counts as
+  // failed until the value is complete.
+  st.failed = true;
+  msgpack::packer<msgpack::sbuffer> packer(st.batch);
+  guile_pack::packDocument(value, packer, st.flags);
+  st.failed = false;
+  detail::countElement(st);
+  detail::flushIfDue(st);
+}
+
+/// Open an array or map.  `count` is the number of elements or pairs, or
+/// unbound / #f to patch the header on end, which needs a seekable port.
+inline void begin(writer_state &st, bool is_map, SCM count) {
+  detail::checkUsable(st);
+  detail::checkRoom(st);
+
+  frame f{is_map, false, 0, 0, -1};
+  if (!SCM_UNBNDP(count) && scm_is_true(count)) {
+    f.declared = scm_to_uint32(count);
+    msgpack::packer<msgpack::sbuffer> packer(st.batch);
+    if (is_map) {
+      packer.pack_map(f.declared);
+    } else {
+      packer.pack_array(f.declared);
+    }
+  } else {
+    detail::flush(st);
+    f.patched = true;
+    f.header_pos = detail::tell(st.port);
+    if (f.header_pos < 0) {
+      throw stream_error("port cannot seek; declare the element count");
+    }
+    // array32 / map32 with a zero count.
+    const char placeholder[5] = {is_map ? '\xdf' : '\xdd', 0, 0, 0, 0};
+    st.batch.write(placeholder, sizeof(placeholder));
+  }
+
+  detail::countElement(st);
+  st.frames.push_back(f);
+}
+
+/// Close the innermost open container.
+inline void end(writer_state &st) {
+  detail::checkUsable(st);
+  if (st.frames.empty()) {
+    throw stream_error("no open array or map to end");
+  }
+
+  const frame f = st.frames.back();
+  if (f.is_map && f.written % 2 != 0) {
+    throw stream_error("map ended after a key with no value");
+  }
+  uint64_t n = f.is_map ? f.written / 2 : f.written;
+  if (!f.patched && n != f.declared) {
+    throw stream_error("container ended with fewer elements than declared");
+  }
+
+  if (f.patched) {
+    if (n > UINT32_MAX) {
+      throw stream_error("too many elements for a msgpack container");
+    }
+    detail::flush(st);
+    st.failed = true;
+    SCM end_pos = scm_seek(st.port, SCM_INUM0, scm_from_int(SEEK_CUR));
+    scm_seek(st.port, scm_from_int64(f.header_pos + 1),
+             scm_from_int(SEEK_SET));
+    const char size[4] = {
+        static_cast<char>(n >> 24), static_cast<char>(n >> 16),
+        static_cast<char>(n >> 8), static_cast<char>(n)};
+    scm_c_write(st.port, size, sizeof(size));
+    scm_seek(st.port, end_pos, scm_from_int(SEEK_SET));
+    st.failed = false;
+  }
+
+  st.frames.pop_back();
+  detail::flushIfDue(st);
+}
+
+/// Pack everything a generator yields, up to the eof object, as one array.
+/// Returns the number of elements written.
+inline SCM packGenerator(SCM port, SCM generator, SCM count,
+                         guile_pack::flags_type flags) {
+  SCM writer = makeWriter(port, flags);
+  writer_state &st = stateOf(writer);
+  begin(st, false, count);
+  size_t n = 0;
+  for (SCM value = scm_call_0(generator); !SCM_EOF_OBJECT_P(value);
+       value = scm_call_0(generator)) {
+    write(st, value);
+    n++;
+  }
+  end(st);
+  scm_remember_upto_here_1(writer);
+  return scm_from_size_t(n);
+}
+
+} // namespace guile_stream
@@ -0,0 +1,165 @@
+#pragma once
+
+#include "guile_ext.hpp"
+#include "guile_record.hpp"
+#include "guile_shared.hpp"
+#include <cstdint>
+#include <string>
+
+#include <msgpack.hpp>
+
+// The msgpack timestamp extension (-1) mapped to SRFI-19 time objects.
+// Decoding yields time-utc objects; packing applies to time-utc objects and
+// picks the smallest of the 32, 64 and 96 bit layouts.
+namespace guile_timestamp {
+
+using timestamp_error = std::runtime_error;
+
+namespace detail {
+
+// Slots of the SRFI-19 time record, found by field name.
+struct time_slots {
+  SCM vtable = SCM_BOOL_F;
+  SCM time_utc = SCM_BOOL_F;
+  size_t type = 0;
+  size_t nanosecond = 0;
+  size_t second = 0;
+};
+
+/// Resolved on first use; loads (srfi srfi-19) if needed.  Field positions
+/// are read from the record type directly rather than through
+/// guile_record::layoutOfVtable, whose hooks call back into this function.
+inline const time_slots &srfi19() {
+  static const time_slots slots = []() {
+    time_slots s;
+    s.vtable = scm_permanent_object(scm_c_private_ref("srfi srfi-19", "time"));
+    s.time_utc = scm_from_utf8_symbol("time-utc");
+
+    int found = 0;
+    size_t slot = 0;
+    for (SCM fields = scm_call_1(guile_record::detail::guileRef(
+                                     "record-type-fields"),
+                                 s.vtable);
+         scm_is_pair(fields); fields = SCM_CDR(fields), slot++) {
+      std::string name = guile_record::detail::utf8Of(
+          scm_symbol_to_string(SCM_CAR(fields)));
+      size_t *target = name == "type"         ? &s.type
+                       : name == "nanosecond" ? &s.nanosecond
+                       : name == "second"     ? &s.second
+                                              : nullptr;
+      if (target != nullptr) {
+        *target = slot;
+        found++;
+      }
+    }
+    if (found != 3) {
+      throw timestamp_error("unexpected SRFI-19 time record layout");
+    }
+    return s;
+  }();
+  return slots;
+}
+
+inline void writeBE(guile_ext::body_buffer &out, uint64_t v, size_t n) {
+  char buf[8];
+  for (size_t i = 0; i < n; i++) {
+    buf[n - 1 - i] = static_cast<char>(v & 0xff);
+    v >>= 8;
+  }
+  out.write(buf, n);
+}
+
+inline uint64_t readBE(const char *p, size_t n) {
+  uint64_t v = 0;
+  for (size_t i = 0; i < n; i++) {
+    v = (v << 8) | static_cast<unsigned char>(p[i]);
+  }
+  return v;
+}
+
+} // namespace detail
+
+/// pack_fn for SRFI-19 time objects.  Declines anything but time-utc.
+inline bool packTime(SCM value, guile_ext::body_buffer &body, void *) {
+  const detail::time_slots &slots = detail::srfi19();
+  if (!scm_is_eq(SCM_STRUCT_SLOT_REF(value, slots.type), slots.time_utc)) {
+    return false;
+  }
+
+  int64_t sec = scm_to_int64(SCM_STRUCT_SLOT_REF(value, slots.second));
+  uint32_t nsec = scm_to_uint32(SCM_STRUCT_SLOT_REF(value, slots.nanosecond));
+  if (nsec >= 1000000000) {
+    return false;
+  }
+
+  if ((static_cast<uint64_t>(sec) >> 34) == 0) {
+    uint64_t data64 = (static_cast<uint64_t>(nsec) << 34) |
+                      static_cast<uint64_t>(sec);
+    if ((data64 & 0xffffffff00000000ull) == 0) {
+      detail::writeBE(body, data64, 4);
+    } else {
+      detail::writeBE(body, data64, 8);
+    }
+  } else {
+    detail::writeBE(body, nsec, 4);
+    detail::writeBE(body, static_cast<uint64_t>(sec), 8);
+  }
+  return true;
+}
+
+/// unpack_fn for the timestamp ext: 4, 8 or 12 byte bodies.
+inline SCM unpackTime(const char *data, size_t len, void *) {
+  uint64_t nsec;
+  int64_t sec;
+  switch (len) {
+  case 4:
+    nsec = 0;
+    sec = static_cast<int64_t>(detail::readBE(data, 4));
+    break;
+  case 8: {
+    uint64_t data64 = detail::readBE(data, 8);
+    nsec = data64 >> 34;
+    sec = static_cast<int64_t>(data64 & 0x00000003ffffffffull);
+    break;
+  }
+  case 12:
+    nsec = detail::readBE(data, 4);
+    sec = static_cast<int64_t>(detail::readBE(data + 4, 8));
+    break;
+  default:
+    throw timestamp_error("invalid msgpack timestamp length");
+  }
+
+  const detail::time_slots &slots = detail::srfi19();
+  SCM time = scm_c_make_structv(slots.vtable, 0, 0, nullptr);
+  SCM_STRUCT_SLOT_SET(time, slots.type, slots.time_utc);
+  SCM_STRUCT_SLOT_SET(time, slots.nanosecond, scm_from_uint64(nsec));
+  SCM_STRUCT_SLOT_SET(time, slots.second, scm_from_int64(sec));
+  return time;
+}
+
+namespace detail {
+
+// Attach packTime to the SRFI-19 time record type when its layout is first
+// computed.  Only record types named `time` pay for the module lookup.
+inline void attachToTimeLayout(SCM vtable,
+                               guile_record::record_layout &layout) {
+  if (layout.type_name != "time" || !scm_is_eq(vtable, srfi19().vtable)) {
+    return;
+  }
+  layout.ext_packer.store(guile_ext::makePackHandler(
+                              {guile_shared::timestamp_ext_id, &packTime,
+                               nullptr, SCM_BOOL_F}),
+                          std::memory_order_release);
+}
+
+} // namespace detail
+
+/// Register the timestamp ext handlers.  Call once at module init.
+inline void install() {
+  guile_ext::registerUnpacker(guile_shared::timestamp_ext_id,
+                              {&unpackTime, nullptr, SCM_BOOL_F});
+  guile_record::layoutHooks().push_back(&detail::attachToTimeLayout);
+}
+
+} // namespace guile_timestamp
@@ -1,14 +1,24 @@
 #pragma once
 
+#include "guile_ext.hpp"
+#include "guile_lz.hpp"
 #include "guile_object.hpp"
+#include "guile_record.hpp"
+#include "guile_scan.hpp"
 #include "guile_shared.hpp"
+#include "guile_stats.hpp"
 #include "libguile/numbers.h"
 #include "libguile/pairs.h"
 #include "libguile/symbols.h"
+#include <algorithm>
 #include <iostream>
 #include <msgpack.hpp>
+#include <new>
+#include <optional>
 #include <type_traits>
 
+#include <gc/gc.h>
+
 namespace guile_unpack {
 
 using unpack_error = std::runtime_error;
@@ -20,6 +30,10 @@ inline scm_t unpackDispatch(object_handle_t &object, flags_t flags);
 enum class unpack_flags : uint64_t {
   disable_symbol_extension = 1 << 0,
   disable_keyword_extension = 1 << 1,
+  // Arrays decode to lists instead of vectors.
+  arrays_as_lists = 1 << 2,
+  // Maps decode to association lists instead of hashtables.
+  maps_as_alists = 1 << 3,
 };
 
 constexpr uint64_t operator&(unpack_flags lhs, unpack_flags rhs) noexcept {
@@ -38,9 +52,251 @@ constexpr uint64_t operator|(uint64_t lhs, unpack_flags rhs) noexcept {
   return lhs | static_cast<uint64_t>(rhs);
 }
 
+// Resolution of the shared structure exts written by guile_pack with
+// share_structure.  Definitions are numbered per document, so every decode of
+// a whole document runs inside its own scope.
+namespace share {
+
+struct state {
+  // Index -> object for the definitions decoded so far.
+  scm_t objects = SCM_BOOL_F;
+  // The body of the definition being decoded.  A container built for exactly
+  // this object registers itself before its children are decoded, so that
+  // references back into it from inside resolve.
+  const msgpack::object *pending = nullptr;
+  uint32_t pending_index = 0;
+};
+
+inline thread_local state *current = nullptr;
+
+/// Installs a fresh state for one document on the calling thread.  Lives on
+/// the C stack, where the collector sees the table it holds.
+class scope {
+public:
+  scope() : prev_(current) { current = &state_; }
+  scope(const scope &) = delete;
+  scope &operator=(const scope &) = delete;
+  ~scope() { unwind(); }
+
+  /// Put back the previous state; see unpackDocument.
+  void unwind() noexcept { current = prev_; }
+
+private:
+  state state_;
+  state *prev_;
+};
+
+inline void define(state &st, uint32_t index, scm_t value) {
+  if (scm_is_false(st.objects)) {
+    st.objects = scm_c_make_hash_table(64);
+  }
+  scm_hashv_set_x(st.objects, scm_from_uint32(index), value);
+}
+
+/// Called by container unpackers right after allocating their result.
+inline void claim(object_handle_t &handle, scm_t value) {
+  state *st = current;
+  if (st != nullptr && st->pending == &handle) {
+    st->pending = nullptr;
+    define(*st, st->pending_index, value);
+  }
+}
+
+inline uint32_t indexOf(const msgpack::object &index) {
+  if (index.type != msgpack::type::object_type::POSITIVE_INTEGER ||
+      index.via.u64 > UINT32_MAX) {
+    throw unpack_error("malformed shared structure index");
+  }
+  return static_cast<uint32_t>(index.via.u64);
+}
+
+inline state &active() {
+  if (current == nullptr) {
+    throw unpack_error("shared structure ext outside of a document");
+  }
+  return *current;
+}
+
+} // namespace share
+
+// Ext bodies that are msgpack themselves, those of records and shared
+// structure exts, are parsed into one zone per document instead of a zone per
+// body.  The outer parse leaves them as ext payloads pointing into the input,
+// so each body is parsed once however deeply records nest.  The zone is only
+// created by the first such body and lives until the document is decoded.
+//
+// The document's own validation passes over these bodies as opaque payload,
+// so each object is validated against the current limits before it is
+// parsed, and the levels bodies add count towards max_depth together with
+// the bodies they sit in.  A chain of nested bodies thus ends at max_depth
+// rather than when the C stack runs out.
+namespace nested {
+
+struct state {
+  std::optional<msgpack::zone> zone;
+  // Nesting levels taken by the bodies being decoded.
+  uint64_t depth = 0;
+};
+
+inline thread_local state *current = nullptr;
+
+/// Installs a fresh state for one document on the calling thread.
+class scope {
+public:
+  scope() : prev_(current) { current = &state_; }
+  scope(const scope &) = delete;
+  scope &operator=(const scope &) = delete;
+  ~scope() { unwind(); }
+
+  /// Free the zone and put back the previous state; see unpackDocument.
+  void unwind() noexcept {
+    state_.zone.reset();
+    current = prev_;
+  }
+
+private:
+  state state_;
+  state *prev_;
+};
+
+/// One ext body, or a decompressed frame, being decoded.  Lives on the C
+/// stack for as long as the objects parsed from it are being decoded; its
+/// levels are released when it goes.
+class body {
+public:
+  body(const char *data, size_t len)
+      : st_(active()), data_(data), len_(len), saved_depth_(st_.depth) {}
+  body(const body &) = delete;
+  body &operator=(const body &) = delete;
+  ~body() { st_.depth = saved_depth_; }
+
+  /// Validate and parse the next object of the body.  Strings and binaries
+  /// point into the body's bytes.
+  msgpack::object next() {
+    const guile_scan::limits &limits = guile_scan::currentLimits();
+    guile_scan::summary s = guile_scan::validate(data_, len_, off_, limits);
+    uint64_t depth = saved_depth_ + s.depth + 1;
+    if (depth > limits.max_depth) {
+      throw unpack_error("msgpack nesting exceeds limit");
+    }
+    st_.depth = std::max(st_.depth, depth);
+
+    if (!st_.zone) {
+      st_.zone.emplace();
+    }
+    return msgpack::unpack(*st_.zone, data_, len_, off_,
+                           guile_shared::detail::referenceAll);
+  }
+
+private:
+  static state &active() {
+    if (current == nullptr) {
+      throw unpack_error("nested ext body outside of a document");
+    }
+    return *current;
+  }
+
+  state &st_;
+  const char *data_;
+  size_t len_;
+  size_t off_ = 0;
+  uint64_t saved_depth_;
+};
+
+} // namespace nested
+
+/// Expand the body of a compressed ext, a 4 byte big endian size followed
+/// by the compressed document, into doc.  The size is checked against the
+/// frame and the payload limit before anything is allocated for it.
+inline void inflateFrame(const char *data, size_t len, std::vector<char> &doc) {
+  if (len < 4) {
+    throw unpack_error("truncated compressed frame");
+  }
+  const auto *p = reinterpret_cast<const unsigned char *>(data);
+  size_t size = (size_t{p[0]} << 24) | (size_t{p[1]} << 16) |
+                (size_t{p[2]} << 8) | size_t{p[3]};
+  size_t block = len - 4;
+  // Each compressed byte expands to at most 255, so anything larger is a
+  // corrupt or hostile frame.
+  if (size > block * 255) {
+    throw unpack_error("compressed frame size is implausible");
+  }
+  if (size > guile_scan::currentLimits().max_payload) {
+    throw unpack_error("decompressed frame exceeds payload limit");
+  }
+
+  doc.resize(size);
+  if (!guile_lz::decompress(data + 4, block, doc.data(), size)) {
+    throw unpack_error("corrupt compressed frame");
+  }
+}
+
+// Pair allocation for list decoding.  Long lists take their pairs from
+// GC_malloc_many, which hands out a whole heap block of two-word objects
+// per call under one allocator lock.  Each pair is still an object of its
+// own: Guile only recognises pointers to the start of an object, so pairs
+// carved from one big allocation would be freed while a pointer to any but
+// the first was still live.
+namespace pairs {
+
+// Below this, pairs come from scm_cons.  The rest of a GC_malloc_many batch
+// that a list does not use is dropped, so short lists would waste most of
+// it.
+constexpr size_t bulk_threshold = 256;
+
+/// Hands out fresh (#f . ()) pairs.  Lives on the C stack, where the
+/// collector sees the unused part of the current batch through free_.
+class allocator {
+public:
+  explicit allocator(size_t n) : bulk_(n >= bulk_threshold) {}
+  allocator(const allocator &) = delete;
+  allocator &operator=(const allocator &) = delete;
+
+  scm_t next() {
+    if (!bulk_) {
+      return scm_cons(SCM_BOOL_F, SCM_EOL);
+    }
+    if (free_ == nullptr) {
+      free_ = GC_malloc_many(2 * sizeof(scm_t));
+      if (free_ == nullptr) {
+        throw std::bad_alloc();
+      }
+    }
+    void *cell = free_;
+    free_ = GC_NEXT(cell);
+    scm_t pair = SCM_PACK_POINTER(cell);
+    SCM_SETCAR(pair, SCM_BOOL_F);
+    SCM_SETCDR(pair, SCM_EOL);
+    return pair;
+  }
+
+private:
+  bool bulk_;
+  void *free_ = nullptr;
+};
+
+/// A list of n fresh pairs, or () when n is 0.  The whole spine exists
+/// before any element is decoded, so the head can be claimed as a shared
+/// definition first.
+inline scm_t spine(allocator &alloc, size_t n) {
+  if (n == 0) {
+    return SCM_EOL;
+  }
+  scm_t head = alloc.next();
+  scm_t tail = head;
+  for (size_t i = 1; i < n; i++) {
+    scm_t pair = alloc.next();
+    SCM_SETCDR(tail, pair);
+    tail = pair;
+  }
+  return head;
+}
+
+} // namespace pairs
+
 template <msgpack::type::object_type T> struct GuileUnpacker : std::false_type {
   static inline scm_t unpack(object_handle_t &handle, flags_t flags) {
-    throw new unpack_error("cannot unpack object of unknown type");
+    throw unpack_error("cannot unpack object of unknown type");
   }
 };
 
@@ -134,13 +390,31 @@ struct GuileUnpacker<msgpack::type::object_type::ARRAY> : std::true_type {
   static inline scm_t unpack(object_handle_t &handle, flags_t flags) {
     assert(handle.type == msgpack::type::object_type::ARRAY);
     auto data = handle.via.array;
+    if ((flags & unpack_flags::arrays_as_lists) != 0) {
+      return unpackList(handle, flags);
+    }
     scm_t result = scm_c_make_vector(data.size, SCM_BOOL_F);
+    share::claim(handle, result);
 
     for (uint32_t i = 0; i < data.size; i++) {
       scm_c_vector_set_x(result, i, unpackDispatch(data.ptr[i], flags));
     }
     return result;
   }
+
+private:
+  static inline scm_t unpackList(object_handle_t &handle, flags_t flags) {
+    auto data = handle.via.array;
+    pairs::allocator alloc(data.size);
+    scm_t result = pairs::spine(alloc, data.size);
+    share::claim(handle, result);
+
+    scm_t current = result;
+    for (uint32_t i = 0; i < data.size; i++, current = SCM_CDR(current)) {
+      SCM_SETCAR(current, unpackDispatch(data.ptr[i], flags));
+    }
+    return result;
+  }
 };
 
 // TODO
@@ -149,13 +423,40 @@ struct GuileUnpacker<msgpack::type::object_type::MAP> : std::true_type {
   static inline scm_t unpack(object_handle_t &handle, flags_t flags) {
     assert(handle.type == msgpack::type::object_type::MAP);
     auto data = handle.via.map;
-    scm_t result = scm_c_make_hash_table(data.size);
+    if ((flags & unpack_flags::maps_as_alists) != 0) {
+      return unpackAlist(handle, flags);
+    }
+    // Guile grows a table once it is more than 9/10 full; sizing for that up
+    // front means decoding never rehashes.
+    scm_t result = scm_c_make_hash_table(data.size * 10 / 9 + 1);
+    share::claim(handle, result);
     for (uint32_t i = 0; i < data.size; i++) {
       scm_hash_set_x(result, unpackDispatch(data.ptr[i].key, flags),
                      unpackDispatch(data.ptr[i].val, flags));
     }
     return result;
   }
+
+private:
+  /// Entries keep their wire order.  The entry pairs come from the same
+  /// allocator as the spine.
+  static inline scm_t unpackAlist(object_handle_t &handle, flags_t flags) {
+    auto data = handle.via.map;
+    pairs::allocator alloc(2 * size_t{data.size});
+    scm_t result = pairs::spine(alloc, data.size);
+    for (scm_t p = result; SCM_CONSP(p); p = SCM_CDR(p)) {
+      SCM_SETCAR(p, alloc.next());
+    }
+    share::claim(handle, result);
+
+    scm_t current = result;
+    for (uint32_t i = 0; i < data.size; i++, current = SCM_CDR(current)) {
+      scm_t entry = SCM_CAR(current);
+      SCM_SETCAR(entry, unpackDispatch(data.ptr[i].key, flags));
+      SCM_SETCDR(entry, unpackDispatch(data.ptr[i].val, flags));
+    }
+    return result;
+  }
 };
 
 // TODO
@@ -181,15 +482,133 @@ struct GuileUnpacker<msgpack::type::object_type::EXT> : std::true_type {
       }
     case guile_shared::nil_ext_id:
       return SCM_EOL;
+    case guile_shared::shared_def_ext_id:
+      return unpackSharedDef(data, flags);
+    case guile_shared::shared_ref_ext_id:
+      return unpackSharedRef(data);
+    case guile_shared::compressed_ext_id:
+      return unpackCompressed(data, flags);
+    case guile_shared::record_ext_id:
+      if (scm_t record = unpackNamedRecord(handle, flags);
+          scm_is_true(record)) {
+        return record;
+      }
+      break;
     default:
-      scm_t bvec = scm_c_make_bytevector(data.size);
-      memcpy(SCM_BYTEVECTOR_CONTENTS(bvec), data.ptr, data.size);
-      return scm_cons(scm_from_int8(data.type()), bvec);
+      if (auto *handler = guile_ext::unpackerFor(data.type())) {
+        return guile_ext::unpackWith(*handler, data.data(), data.size);
+      }
+      if (auto *entry = guile_record::entryForExt(data.type())) {
+        return unpackTaggedRecord(*entry, handle, flags);
+      }
+      break;
     }
+
+    scm_t bvec = scm_c_make_bytevector(data.size);
+    memcpy(SCM_BYTEVECTOR_CONTENTS(bvec), data.ptr, data.size);
+    return scm_cons(scm_from_int8(data.type()), bvec);
+  }
+
+private:
+  static inline scm_t unpackCompressed(const msgpack::object_ext &data,
+                                       flags_t flags) {
+    guile_shared::unwind_scope scope;
+    std::vector<char> doc;
+    scope.destroy(doc);
+    inflateFrame(data.data(), data.size, doc);
+    nested::body frame(doc.data(), doc.size());
+    return unpackDispatch(frame.next(), flags);
+  }
+
+  static inline scm_t unpackSharedDef(const msgpack::object_ext &data,
+                                      flags_t flags) {
+    share::state &st = share::active();
+    nested::body def(data.data(), data.size);
+    msgpack::object index = def.next();
+    msgpack::object body = def.next();
+
+    uint32_t i = share::indexOf(index);
+    st.pending = &body;
+    st.pending_index = i;
+    scm_t value = unpackDispatch(body, flags);
+    if (st.pending == &body) {
+      st.pending = nullptr;
+    }
+    share::define(st, i, value);
+    return value;
+  }
+
+  static inline scm_t unpackSharedRef(const msgpack::object_ext &data) {
+    share::state &st = share::active();
+    nested::body ref(data.data(), data.size);
+    uint32_t i = share::indexOf(ref.next());
+    scm_t value = SCM_UNDEFINED;
+    if (scm_is_true(st.objects)) {
+      value = scm_hashv_ref(st.objects, scm_from_uint32(i), SCM_UNDEFINED);
+    }
+    if (SCM_UNBNDP(value)) {
+      throw unpack_error("unresolved shared structure reference");
+    }
+    return value;
+  }
+
+  static inline scm_t
+  unpackTaggedRecord(const guile_record::record_tag_entry &entry,
+                     object_handle_t &handle, flags_t flags) {
+    const msgpack::object_ext &data = handle.via.ext;
+    nested::body body(data.data(), data.size);
+    msgpack::object fields = body.next();
+    if (fields.type != msgpack::type::object_type::ARRAY) {
+      throw unpack_error("tagged record body is not an array");
+    }
+    return guile_record::construct(
+        entry, fields.via.array.size,
+        [&](size_t i) {
+          return unpackDispatch(fields.via.array.ptr[i], flags);
+        },
+        [&](scm_t record) { share::claim(handle, record); });
+  }
+
+  // Positional records carry their type name; they are only rebuilt when a
+  // type of that name has been registered.  Returns #f otherwise.
+  static inline scm_t unpackNamedRecord(object_handle_t &handle,
+                                        flags_t flags) {
+    const msgpack::object_ext &data = handle.via.ext;
+    nested::body body(data.data(), data.size);
+    msgpack::object fields = body.next();
+    if (fields.type != msgpack::type::object_type::ARRAY ||
+        fields.via.array.size == 0) {
+      return SCM_BOOL_F;
+    }
+
+    const msgpack::object &name = fields.via.array.ptr[0];
+    const char *name_ptr;
+    size_t name_len;
+    if (name.type == msgpack::type::object_type::EXT) {
+      name_ptr = name.via.ext.data();
+      name_len = name.via.ext.size;
+    } else if (name.type == msgpack::type::object_type::STR) {
+      name_ptr = name.via.str.ptr;
+      name_len = name.via.str.size;
+    } else {
+      return SCM_BOOL_F;
+    }
+
+    auto *entry = guile_record::entryForName(std::string(name_ptr, name_len));
+    if (entry == nullptr) {
+      return SCM_BOOL_F;
+    }
+    return guile_record::construct(
+        *entry, fields.via.array.size - 1,
+        [&](size_t i) {
+          return unpackDispatch(fields.via.array.ptr[i + 1], flags);
+        },
+        [&](scm_t record) { share::claim(handle, record); });
   }
 };
 
 inline scm_t unpackDispatch(object_handle_t &object, flags_t flags) {
+  guile_stats::countUnpack(object.type);
   switch (object.type) {
 
   case msgpack::type::NIL:
@@ -219,4 +638,42 @@ inline scm_t unpackDispatch(object_handle_t &object, flags_t flags) {
   }
 }
 
+namespace detail {
+
+struct document_scopes {
+  share::scope share;
+  nested::scope nested;
+
+  static void unwind(void *data) {
+    auto *scopes = static_cast<document_scopes *>(data);
+    scopes->nested.unwind();
+    scopes->share.unwind();
+  }
+};
+
+} // namespace detail
+
+/// Decode one complete document.  Shared structure references resolve only
+/// against definitions in the same document.  A Scheme throw from inside the
+/// decode (invalid UTF-8, an ext handler) unwinds past the C++ destructors,
+/// so the document's thread state is also put back by a dynwind handler.
+inline scm_t unpackDocument(object_handle_t &object, flags_t flags) {
+  guile_stats::sampled_timer timer(guile_stats::timing::unpack);
+  detail::document_scopes scopes;
+  scm_dynwind_begin(static_cast<scm_t_dynwind_flags>(0));
+  scm_dynwind_unwind_handler(detail::document_scopes::unwind, &scopes,
+                             static_cast<scm_t_wind_flags>(0));
+  scm_t result;
+  try {
+    result = unpackDispatch(object, flags);
+  } catch (...) {
+    // C++ exceptions leave through the destructors; the context still has
+    // to be closed.
+    scm_dynwind_end();
+    throw;
+  }
+  scm_dynwind_end();
+  return result;
+}
+
 }; // namespace guile_unpack
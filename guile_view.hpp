@@ -0,0 +1,426 @@
+#pragma once
+
+#include "guile_object.hpp"
+#include "guile_scan.hpp"
+#include "guile_shared.hpp"
+#include "guile_unpack.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <msgpack.hpp>
+
+// Lazy, random access views over encoded msgpack.  A view names one object
+// inside a bytevector; containers build an offset index of their children the
+// first time they are indexed, and only the leaves actually requested are
+// decoded.
+namespace guile_view {
+
+using view_error = std::runtime_error;
+using flags_t = guile_unpack::flags_t;
+
+/// Per view state.  Allocated with scm_gc_malloc so that `source` keeps the
+/// bytevector alive for as long as any view into it is reachable.
+struct view_node {
+  SCM source;
+  size_t start;
+  size_t end;
+  guile_scan::header head;
+  // Child offsets, built on first access.  Arrays store count + 1 entries,
+  // maps 2 * count + 1 (key, value, key, value, ..., end).
+  size_t *index;
+};
+
+inline SCM view_type = SCM_BOOL_F;
+
+inline void initViewType() {
+  view_type = scm_make_foreign_object_type(
+      scm_from_utf8_symbol("msgpack-view"),
+      scm_list_1(scm_from_utf8_symbol("node")), nullptr);
+}
+
+inline bool isView(SCM value) {
+  return SCM_STRUCTP(value) && scm_is_eq(SCM_STRUCT_VTABLE(value), view_type);
+}
+
+inline view_node *nodeOf(SCM view) {
+  scm_assert_foreign_object_type(view_type, view);
+  return static_cast<view_node *>(scm_foreign_object_ref(view, 0));
+}
+
+namespace detail {
+
+inline const char *bytesOf(const view_node *node) {
+  return (const char *)SCM_BYTEVECTOR_CONTENTS(node->source);
+}
+
+inline SCM makeView(SCM source, size_t start, size_t end) {
+  const char *data = (const char *)SCM_BYTEVECTOR_CONTENTS(source);
+  auto *node = static_cast<view_node *>(
+      scm_gc_malloc(sizeof(view_node), "msgpack-view"));
+  node->source = source;
+  node->start = start;
+  node->end = end;
+  node->head = guile_scan::readHeader(data, end, start);
+  node->index = nullptr;
+  return scm_make_foreign_object_1(view_type, node);
+}
+
+inline bool isContainer(const guile_scan::header &h) {
+  return h.type == msgpack::type::object_type::ARRAY ||
+         h.type == msgpack::type::object_type::MAP;
+}
+
+inline void buildIndex(view_node *node) {
+  if (node->index != nullptr) {
+    return;
+  }
+
+  const char *data = bytesOf(node);
+  size_t n = node->head.children;
+  auto *index = static_cast<size_t *>(scm_gc_malloc_pointerless(
+      (n + 1) * sizeof(size_t), "msgpack-view-index"));
+
+  size_t pos = node->start + node->head.header_size;
+  for (size_t i = 0; i < n; i++) {
+    index[i] = pos;
+    pos = guile_scan::skip(data, node->end, pos);
+  }
+  index[n] = pos;
+  node->index = index;
+}
+
+/// Decode the object spanning [start, end) with the regular unpackers.
+inline SCM decodeRange(const char *data, size_t start, size_t end,
+                       flags_t flags) {
+  guile_shared::unwind_scope scope;
+  msgpack::zone zone;
+  scope.destroy(zone);
+  size_t off = start;
+  msgpack::object obj = msgpack::unpack(zone, data, end, off,
+                                        guile_shared::detail::referenceAll);
+  return guile_unpack::unpackDocument(obj, flags);
+}
+
+/// Containers become nested views, everything else is decoded.
+inline SCM childAt(view_node *node, size_t child, flags_t flags) {
+  const char *data = bytesOf(node);
+  size_t start = node->index[child];
+  size_t end = node->index[child + 1];
+  if (isContainer(guile_scan::readHeader(data, end, start))) {
+    return makeView(node->source, start, end);
+  }
+  return decodeRange(data, start, end, flags);
+}
+
+inline bool payloadEquals(const char *data, size_t pos,
+                          const guile_scan::header &h, size_t skip_bytes,
+                          const char *bytes, size_t len) {
+  return h.payload_size - skip_bytes == len &&
+         memcmp(data + pos + h.header_size + skip_bytes, bytes, len) == 0;
+}
+
+/// Compare the encoded integer at data[pos] against an exact integer key,
+/// whatever width it was written in.
+inline bool integerMatches(const char *data, size_t pos,
+                           const guile_scan::header &h, SCM key) {
+  using msgpack::type::object_type;
+  const auto *p = reinterpret_cast<const unsigned char *>(data) + pos;
+  uint64_t raw = h.payload_size == 0
+                     ? p[0]
+                     : guile_scan::detail::readBE(p + 1, h.payload_size);
+  if (h.type == object_type::NEGATIVE_INTEGER) {
+    // Signed encodings: sign extend from the encoded width.
+    unsigned bits = h.payload_size == 0 ? 8 : 8 * h.payload_size;
+    int64_t v = bits == 64 ? static_cast<int64_t>(raw)
+                           : static_cast<int64_t>(raw << (64 - bits)) >>
+                                 (64 - bits);
+    if (v < 0) {
+      return scm_is_signed_integer(key, INT64_MIN, -1) &&
+             scm_to_int64(key) == v;
+    }
+    raw = static_cast<uint64_t>(v);
+  }
+  return scm_is_unsigned_integer(key, 0, UINT64_MAX) &&
+         scm_to_uint64(key) == raw;
+}
+
+/// Compare the encoded key at data[pos] against a Scheme key.  Strings,
+/// symbols and keywords are compared on their raw bytes, integers on their
+/// value whatever width they were written in, and booleans and () on the
+/// marker.  Keys of any other type are decoded and compared with equal?.
+inline bool keyMatches(const char *data, size_t pos, size_t end, SCM key,
+                       const std::string &key_bytes, flags_t flags) {
+  using msgpack::type::object_type;
+  guile_scan::header h = guile_scan::readHeader(data, end, pos);
+
+  if (scm_is_exact_integer(key)) {
+    return (h.type == object_type::POSITIVE_INTEGER ||
+            h.type == object_type::NEGATIVE_INTEGER) &&
+           integerMatches(data, pos, h, key);
+  }
+  if (scm_is_bool(key)) {
+    return h.type == object_type::BOOLEAN &&
+           (static_cast<unsigned char>(data[pos]) == 0xc3) ==
+               scm_is_true(key);
+  }
+  if (scm_is_null(key)) {
+    // () packs as nil; the nil ext decodes to it too.
+    return h.type == object_type::NIL ||
+           (h.type == object_type::EXT &&
+            static_cast<int8_t>(data[pos + h.header_size]) ==
+                guile_shared::nil_ext_id);
+  }
+  if (scm_is_string(key)) {
+    return h.type == object_type::STR &&
+           payloadEquals(data, pos, h, 0, key_bytes.data(), key_bytes.size());
+  }
+  if (scm_is_symbol(key) || scm_is_keyword(key)) {
+    int8_t ext_id = scm_is_symbol(key) ? guile_shared::symbol_ext_id
+                                       : guile_shared::keyword_ext_id;
+    return h.type == object_type::EXT &&
+           static_cast<int8_t>(data[pos + h.header_size]) == ext_id &&
+           payloadEquals(data, pos, h, 1, key_bytes.data(), key_bytes.size());
+  }
+  return scm_is_true(scm_equal_p(decodeRange(data, pos, end, flags), key));
+}
+
+inline std::string keyBytes(SCM key) {
+  SCM name = SCM_BOOL_F;
+  if (scm_is_string(key)) {
+    name = key;
+  } else if (scm_is_symbol(key)) {
+    name = scm_symbol_to_string(key);
+  } else if (scm_is_keyword(key)) {
+    name = scm_symbol_to_string(scm_keyword_to_symbol(key));
+  } else {
+    return std::string();
+  }
+
+  size_t len;
+  std::unique_ptr<char, guile_shared::detail::malloc_deleter> buf{
+      scm_to_utf8_stringn(name, &len)};
+  return std::string(buf.get(), len);
+}
+
+} // namespace detail
+
+/// Make a view of the first document in a bytevector.  The whole document is
+/// validated up front, so later lookups and decodes stay within limits.
+inline SCM viewOf(SCM bytevector) {
+  const char *data = (const char *)SCM_BYTEVECTOR_CONTENTS(bytevector);
+  size_t len = SCM_BYTEVECTOR_LENGTH(bytevector);
+  size_t end =
+      guile_scan::validate(data, len, 0, guile_scan::currentLimits()).end;
+  return detail::makeView(bytevector, 0, end);
+}
+
+/// Number of elements or pairs in a container view, 0 for anything else.
+inline size_t length(SCM view) { return nodeOf(view)->head.count; }
+
+/// Look up an array element by index or a map value by key.  Returns
+/// `missing` when there is no such element.
+inline SCM ref(SCM view, SCM key, SCM missing, flags_t flags) {
+  using msgpack::type::object_type;
+  view_node *node = nodeOf(view);
+
+  if (node->head.type == object_type::ARRAY) {
+    if (node->head.count == 0 ||
+        !scm_is_unsigned_integer(key, 0, node->head.count - 1)) {
+      return missing;
+    }
+    detail::buildIndex(node);
+    return detail::childAt(node, scm_to_size_t(key), flags);
+  }
+
+  if (node->head.type == object_type::MAP) {
+    detail::buildIndex(node);
+    const char *data = detail::bytesOf(node);
+    guile_shared::unwind_scope scope;
+    std::string key_bytes = detail::keyBytes(key);
+    scope.destroy(key_bytes);
+    for (size_t i = 0; i < node->head.count; i++) {
+      if (detail::keyMatches(data, node->index[2 * i],
+                             node->index[2 * i + 1], key, key_bytes, flags)) {
+        return detail::childAt(node, 2 * i + 1, flags);
+      }
+    }
+    return missing;
+  }
+
+  throw view_error("msgpack-view-ref on a view that is not a container");
+}
+
+/// Follow a list of keys and indices from view.  Stops with `missing` as
+/// soon as one step is absent or reaches a leaf with keys left over.
+inline SCM pathRef(SCM view, SCM path, SCM missing, flags_t flags) {
+  SCM current = view;
+  for (; scm_is_pair(path); path = SCM_CDR(path)) {
+    if (!isView(current)) {
+      return missing;
+    }
+    current = ref(current, SCM_CAR(path), missing, flags);
+    if (scm_is_eq(current, missing)) {
+      return missing;
+    }
+  }
+  return current;
+}
+
+/// Fully decode the object a view names.
+inline SCM toScm(SCM view, flags_t flags) {
+  view_node *node = nodeOf(view);
+  return detail::decodeRange(detail::bytesOf(node), node->start, node->end,
+                             flags);
+}
+
+namespace detail {
+
+struct extract_path {
+  std::vector<SCM> keys;
+  std::vector<std::string> key_bytes;
+  size_t slot;
+  // Set once the path has a value.  A map with duplicate keys can lead a
+  // path to a value twice; only the first counts.
+  bool resolved = false;
+};
+
+// Paths still to be followed below a level, and those matching the current
+// child.  One per depth, reused across siblings.
+struct extract_level {
+  std::vector<extract_path *> next;
+  std::vector<extract_path *> matched;
+};
+
+struct extract_state {
+  const char *data;
+  size_t len;
+  SCM results;
+  size_t remaining;
+  flags_t flags;
+  // Sized for the longest path before the walk starts, so references into
+  // it stay valid while it recurses.
+  std::vector<extract_level> levels;
+};
+
+inline bool indexMatches(SCM key, size_t i) {
+  return scm_is_unsigned_integer(key, i, i);
+}
+
+/// Walk the object at pos, where every path in `active` has matched its
+/// first `depth` keys.  Only children that some path continues into are
+/// descended; everything else is skipped by length.  Returns the offset past
+/// the object, or pos unchanged once every path has been resolved.
+inline size_t extractWalk(extract_state &st, size_t pos, size_t depth,
+                          std::vector<extract_path *> &active) {
+  using msgpack::type::object_type;
+
+  std::vector<extract_path *> &next = st.levels[depth].next;
+  next.clear();
+  size_t end = 0;
+  for (auto *path : active) {
+    if (path->resolved) {
+      continue;
+    }
+    if (path->keys.size() == depth) {
+      end = end ? end : guile_scan::skip(st.data, st.len, pos);
+      SCM_SIMPLE_VECTOR_SET(st.results, path->slot,
+                            decodeRange(st.data, pos, end, st.flags));
+      path->resolved = true;
+      st.remaining--;
+    } else {
+      next.push_back(path);
+    }
+  }
+  if (st.remaining == 0) {
+    return pos;
+  }
+
+  guile_scan::header h = guile_scan::readHeader(st.data, st.len, pos);
+  if (next.empty() || !isContainer(h)) {
+    return end ? end : guile_scan::skip(st.data, st.len, pos);
+  }
+
+  std::vector<extract_path *> &matched = st.levels[depth].matched;
+  pos += h.header_size;
+  for (uint32_t i = 0; i < h.count; i++) {
+    matched.clear();
+    if (h.type == object_type::MAP) {
+      size_t value_pos = guile_scan::skip(st.data, st.len, pos);
+      for (auto *path : next) {
+        if (!path->resolved &&
+            keyMatches(st.data, pos, value_pos, path->keys[depth],
+                       path->key_bytes[depth], st.flags)) {
+          matched.push_back(path);
+        }
+      }
+      pos = value_pos;
+    } else {
+      for (auto *path : next) {
+        if (!path->resolved && indexMatches(path->keys[depth], i)) {
+          matched.push_back(path);
+        }
+      }
+    }
+
+    if (matched.empty()) {
+      pos = guile_scan::skip(st.data, st.len, pos);
+    } else {
+      pos = extractWalk(st, pos, depth + 1, matched);
+      if (st.remaining == 0) {
+        return pos;
+      }
+    }
+  }
+  return pos;
+}
+
+} // namespace detail
+
+/// Pull the values at each of `paths` (a list of key/index lists) out of the
+/// first document in data in a single forward pass, after the document has
+/// been validated against the current limits.  No Guile objects are built
+/// except the requested values themselves, and map keys that are not
+/// strings, symbols, keywords, integers, booleans or ().  Returns a list
+/// aligned with `paths`, holding `missing` where a path is absent.
+inline SCM extract(const char *data, size_t len, SCM paths, SCM missing,
+                   flags_t flags) {
+  guile_scan::validate(data, len, 0, guile_scan::currentLimits());
+  guile_shared::unwind_scope scope;
+  std::vector<detail::extract_path> storage;
+  scope.destroy(storage);
+  size_t max_depth = 0;
+  for (SCM p = paths; scm_is_pair(p); p = SCM_CDR(p)) {
+    SCM keys = scm_is_pair(SCM_CAR(p)) || scm_is_null(SCM_CAR(p))
+                   ? SCM_CAR(p)
+                   : scm_list_1(SCM_CAR(p));
+    detail::extract_path path{{}, {}, storage.size()};
+    for (; scm_is_pair(keys); keys = SCM_CDR(keys)) {
+      path.keys.push_back(SCM_CAR(keys));
+      path.key_bytes.push_back(detail::keyBytes(SCM_CAR(keys)));
+    }
+    max_depth = std::max(max_depth, path.keys.size());
+    storage.push_back(std::move(path));
+  }
+
+  std::vector<detail::extract_path *> active;
+  scope.destroy(active);
+  for (auto &path : storage) {
+    active.push_back(&path);
+  }
+
+  detail::extract_state st{data, len,
+                           scm_c_make_vector(storage.size(), missing),
+                           storage.size(), flags,
+                           std::vector<detail::extract_level>(max_depth + 1)};
+  scope.destroy(st.levels);
+  if (!active.empty()) {
+    detail::extractWalk(st, 0, 0, active);
+  }
+  return scm_vector_to_list(st.results);
+}
+
+} // namespace guile_view